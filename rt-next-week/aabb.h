@@ -2,7 +2,12 @@
 
 #include "interval.h"
 #include "ray.h"
+#include "rtweekend.h"
 #include "vec3.h"
+#include <cmath>
+#include <initializer_list>
+#include <limits>
+
 class aabb {
   public:
     interval x, y, z;
@@ -39,7 +44,7 @@ class aabb {
 
         for(int axis = 0; axis < 3; axis++) {
             const interval& ax = axis_interval(axis);
-            const double adinv = 1.0 / ray_dir[axis];
+            const real adinv = 1 / ray_dir[axis];
 
             auto t0 = (ax.min - ray_orig[axis]) * adinv;
             auto t1 = (ax.max - ray_orig[axis]) * adinv;
@@ -47,13 +52,13 @@ class aabb {
             if(t0 < t1) {
                 if(t0 > ray_t.min)
                     ray_t.min = t0;
-                if(t1 < ray_t.max)
-                    ray_t.max = t1;
+                if(t1 * far_scale < ray_t.max)
+                    ray_t.max = t1 * far_scale;
             } else {
                 if(t1 > ray_t.min)
                     ray_t.min = t1;
-                if(t0 < ray_t.max)
-                    ray_t.max = t0;
+                if(t0 * far_scale < ray_t.max)
+                    ray_t.max = t0 * far_scale;
             }
 
             if(ray_t.max <= ray_t.min)
@@ -71,15 +76,20 @@ class aabb {
 
     static const aabb empty, universe;
 
+    // Widens a far slab distance by the rounding error of computing it (a subtraction and a product, each with
+    // operands already rounded), so a ray grazing a box is not lost in float.
+    static constexpr real far_scale = 1 + 6 * std::numeric_limits<real>::epsilon();
+
   private:
+
+    // Thin boxes get at least 0.001, or more far from the origin, where that would round away in float.
     void pad_to_minimum() {
-        double delta = 0.001;
-        if(x.size() < delta)
-            x = x.expand(delta);
-        if(y.size() < delta)
-            y = y.expand(delta);
-        if(z.size() < delta)
-            z = z.expand(delta);
+        for(interval* ax : {&x, &y, &z}) {
+            auto magnitude = std::fmax(std::fabs(ax->min), std::fabs(ax->max));
+            auto delta = std::isfinite(magnitude) ? min_separation(magnitude) : real(0.001);
+            if(ax->size() < delta)
+                *ax = ax->expand(delta);
+        }
     }
 };
 
@@ -91,3 +101,14 @@ inline aabb operator+(const aabb& bbox, const vec3& offset) {
 }
 
 inline aabb operator+(const vec3& offset, const aabb& bbox) { return bbox + offset; }
+
+// Box between a and b; for boxes moving linearly, this is the box at time t.
+inline aabb lerp(const aabb& a, const aabb& b, real t) {
+    // Sizes interpolate too, so padded ends give a padded result; skipping the constructor keeps this cheap enough
+    // for per-node use in traversal.
+    aabb box;
+    box.x = interval(a.x.min + t * (b.x.min - a.x.min), a.x.max + t * (b.x.max - a.x.max));
+    box.y = interval(a.y.min + t * (b.y.min - a.y.min), a.y.max + t * (b.y.max - a.y.max));
+    box.z = interval(a.z.min + t * (b.z.min - a.z.min), a.z.max + t * (b.z.max - a.z.max));
+    return box;
+}
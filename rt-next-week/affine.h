@@ -0,0 +1,114 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include <array>
+#include <cmath>
+
+// 3x4 affine matrix: a linear part (rotation, scale, shear) followed by a translation. Composition reads right to
+// left, so (a * b) applies b first.
+class affine {
+  public:
+    std::array<std::array<double, 4>, 3> m;
+
+    affine() : m{{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}} {}
+
+    static affine translation(const vec3& offset) {
+        affine a;
+        for(int i = 0; i < 3; i++)
+            a.m[i][3] = offset[i];
+        return a;
+    }
+
+    static affine scaling(const vec3& factors) {
+        affine a;
+        for(int i = 0; i < 3; i++)
+            a.m[i][i] = factors[i];
+        return a;
+    }
+
+    // Counter-clockwise rotation by `degrees` about `axis`, looking down the axis towards the origin.
+    static affine rotation(const vec3& axis, double degrees) {
+        auto k = unit_vector(axis);
+        auto radians = degrees_to_radians(degrees);
+        auto s = std::sin(radians);
+        auto c = std::cos(radians);
+        auto t = 1 - c;
+
+        affine a;
+        a.m[0] = {t * k.x() * k.x() + c, t * k.x() * k.y() - s * k.z(), t * k.x() * k.z() + s * k.y(), 0};
+        a.m[1] = {t * k.x() * k.y() + s * k.z(), t * k.y() * k.y() + c, t * k.y() * k.z() - s * k.x(), 0};
+        a.m[2] = {t * k.x() * k.z() - s * k.y(), t * k.y() * k.z() + s * k.x(), t * k.z() * k.z() + c, 0};
+        return a;
+    }
+
+    // Adds `factor` times coordinate `from` to coordinate `to`.
+    static affine shear(int to, int from, double factor) {
+        affine a;
+        a.m[to][from] = factor;
+        return a;
+    }
+
+    [[nodiscard]] point3 point(const point3& p) const {
+        return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                      m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                      m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+    }
+
+    [[nodiscard]] vec3 vector(const vec3& v) const {
+        return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(), m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                    m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+    }
+
+    // Multiplies by the transposed linear part. Called on the inverse of a matrix, this carries normals through it.
+    [[nodiscard]] vec3 transposed_vector(const vec3& v) const {
+        return vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(), m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                    m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+    }
+
+    // Largest factor by which the linear part can grow a coordinate of a vector (the infinity norm).
+    [[nodiscard]] double norm() const {
+        double largest = 0;
+        for(const auto& row : m)
+            largest = std::fmax(largest, std::fabs(row[0]) + std::fabs(row[1]) + std::fabs(row[2]));
+        return largest;
+    }
+
+    // Of the linear part: the factor by which it scales volumes (negative if it mirrors).
+    [[nodiscard]] double determinant() const {
+        const auto& a = m;
+        return a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) + a[0][1] * (a[1][2] * a[2][0] - a[1][0] * a[2][2]) +
+               a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+    }
+
+    [[nodiscard]] affine inverse() const {
+        const auto& a = m;
+        auto c00 = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+        auto c01 = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+        auto c02 = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+        auto inv_det = 1.0 / (a[0][0] * c00 + a[0][1] * c01 + a[0][2] * c02);
+
+        affine r;
+        r.m[0] = {c00 * inv_det, (a[0][2] * a[2][1] - a[0][1] * a[2][2]) * inv_det,
+                  (a[0][1] * a[1][2] - a[0][2] * a[1][1]) * inv_det, 0};
+        r.m[1] = {c01 * inv_det, (a[0][0] * a[2][2] - a[0][2] * a[2][0]) * inv_det,
+                  (a[0][2] * a[1][0] - a[0][0] * a[1][2]) * inv_det, 0};
+        r.m[2] = {c02 * inv_det, (a[0][1] * a[2][0] - a[0][0] * a[2][1]) * inv_det,
+                  (a[0][0] * a[1][1] - a[0][1] * a[1][0]) * inv_det, 0};
+
+        auto offset = r.vector(vec3(a[0][3], a[1][3], a[2][3]));
+        for(int i = 0; i < 3; i++)
+            r.m[i][3] = -offset[i];
+        return r;
+    }
+};
+
+inline affine operator*(const affine& a, const affine& b) {
+    affine r;
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 4; j++)
+            r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        r.m[i][3] += a.m[i][3];
+    }
+    return r;
+}
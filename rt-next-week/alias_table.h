@@ -0,0 +1,73 @@
+#pragma once
+
+#include "rtweekend.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Discrete distribution over 0..n-1 in proportion to non-negative weights, sampled in constant time (Walker's alias
+// method, built with Vose's worklists). Each bin keeps the chance of returning itself and the index to return
+// otherwise; every bin is equally likely to be picked.
+class alias_table {
+  public:
+    alias_table() = default;
+
+    explicit alias_table(const std::vector<double>& weights) {
+        auto n = weights.size();
+        bins.resize(n);
+        for(const auto w : weights)
+            total += w;
+        if(n == 0 || total <= 0)
+            return;
+
+        std::vector<double> scaled(n);
+        std::vector<std::uint32_t> small, large;
+        for(size_t i = 0; i < n; i++) {
+            bins[i].probability = weights[i] / total;
+            scaled[i] = weights[i] / total * double(n);
+            (scaled[i] < 1 ? small : large).push_back(std::uint32_t(i));
+        }
+
+        while(!small.empty() && !large.empty()) {
+            auto s = small.back(), l = large.back();
+            small.pop_back();
+            bins[s].keep = scaled[s];
+            bins[s].alias = l;
+            scaled[l] -= 1 - scaled[s];
+            if(scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Whatever is left is 1 up to rounding.
+        for(auto i : small)
+            bins[i].keep = 1;
+        for(auto i : large)
+            bins[i].keep = 1;
+    }
+
+    [[nodiscard]] bool empty() const { return total <= 0; }
+    [[nodiscard]] size_t size() const { return bins.size(); }
+
+    // Sum of the weights the table was built from.
+    [[nodiscard]] double weight_sum() const { return total; }
+
+    // Probability of sample() returning i.
+    [[nodiscard]] double probability(size_t i) const { return bins[i].probability; }
+
+    [[nodiscard]] size_t sample() const {
+        auto u = random_double() * double(bins.size());
+        auto i = std::min(size_t(u), bins.size() - 1);
+        return u - double(i) < bins[i].keep ? i : bins[i].alias;
+    }
+
+  private:
+    struct bin {
+        double probability = 0;
+        double keep = 1;
+        std::uint32_t alias = 0;
+    };
+
+    std::vector<bin> bins;
+    double total = 0;
+};
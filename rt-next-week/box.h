@@ -0,0 +1,155 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "interval.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Axis-aligned box intersected with a single slab test. Faces report the same normals and (u, v) parameterization
+// as the six quads the box used to be built from, so textures map identically.
+class box : public hittable {
+  public:
+    box(const point3& a, const point3& b, shared_ptr<material> mat) : mat(std::move(mat)) {
+        min = point3(std::fmin(a.x(), b.x()), std::fmin(a.y(), b.y()), std::fmin(a.z(), b.z()));
+        max = point3(std::fmax(a.x(), b.x()), std::fmax(a.y(), b.y()), std::fmax(a.z(), b.z()));
+        bbox = aabb(min, max);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        real t;
+        int face;
+        if(!nearest_face(r, ray_t, t, face))
+            return false;
+
+        rec.t = t;
+        rec.object = this;
+        rec.primitive = std::uint32_t(face);
+        return true;
+    }
+
+    void finalize(const ray& r, hit_record& rec) const override {
+        const int face = int(rec.primitive);
+        rec.p = r.at(rec.t);
+        rec.mat = mat.get();
+        face_uv(face, rec.p, rec.u, rec.v);
+        rec.set_face_normal(r, face_normal(face));
+        // Each face's (u, v) spans it once.
+        auto size = max - min;
+        rec.texture_scale = 1 / std::sqrt(size[(face / 2 + 1) % 3] * size[(face / 2 + 2) % 3]);
+    }
+
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        real t;
+        int face;
+        return nearest_face(r, ray_t, t, face);
+    }
+
+    void inside(const ray& r, interval ray_t, interval_list& spans) const override {
+        real t_enter, t_exit;
+        int enter_face, exit_face;
+        if(slabs(r, t_enter, t_exit, enter_face, exit_face))
+            spans.add(interval(std::fmax(t_enter, ray_t.min), std::fmin(t_exit, ray_t.max)));
+    }
+
+    [[nodiscard]] aabb bounding_box() const override { return bbox; }
+
+  private:
+    point3 min, max;
+    shared_ptr<material> mat;
+    aabb bbox;
+
+    // Faces are numbered axis * 2 + (0 for the min side, 1 for the max side). Rays starting inside report the face
+    // they leave through, as the closest of the six quads would.
+    bool nearest_face(const ray& r, const interval& ray_t, real& t, int& face) const {
+        real t_enter, t_exit;
+        int enter_face, exit_face;
+        if(!slabs(r, t_enter, t_exit, enter_face, exit_face))
+            return false;
+
+        if(ray_t.surrounds(t_enter)) {
+            t = t_enter;
+            face = enter_face;
+            return true;
+        }
+        if(ray_t.surrounds(t_exit)) {
+            t = t_exit;
+            face = exit_face;
+            return true;
+        }
+        return false;
+    }
+
+    // Entry and exit of the infinite line through the box, with the faces they cross.
+    bool slabs(const ray& r, real& t_enter, real& t_exit, int& enter_face, int& exit_face) const {
+        t_enter = -infinity;
+        t_exit = infinity;
+        enter_face = exit_face = 0;
+
+        for(int axis = 0; axis < 3; axis++) {
+            auto inv_d = 1 / r.direction()[axis];
+            auto t0 = (min[axis] - r.origin()[axis]) * inv_d;
+            auto t1 = (max[axis] - r.origin()[axis]) * inv_d;
+            int f0 = 2 * axis, f1 = 2 * axis + 1;
+            if(t0 > t1) {
+                std::swap(t0, t1);
+                std::swap(f0, f1);
+            }
+            if(t0 > t_enter) {
+                t_enter = t0;
+                enter_face = f0;
+            }
+            if(t1 < t_exit) {
+                t_exit = t1;
+                exit_face = f1;
+            }
+        }
+
+        return t_enter <= t_exit;
+    }
+
+    static vec3 face_normal(int face) {
+        vec3 n(0, 0, 0);
+        n[face / 2] = (face % 2 == 0) ? -1.0 : 1.0;
+        return n;
+    }
+
+    void face_uv(int face, const point3& p, real& u, real& v) const {
+        auto rx = (p.x() - min.x()) / (max.x() - min.x());
+        auto ry = (p.y() - min.y()) / (max.y() - min.y());
+        auto rz = (p.z() - min.z()) / (max.z() - min.z());
+
+        switch(face) {
+        case 0: // left
+            u = rz;
+            v = ry;
+            break;
+        case 1: // right
+            u = 1 - rz;
+            v = ry;
+            break;
+        case 2: // bottom
+            u = rx;
+            v = rz;
+            break;
+        case 3: // top
+            u = rx;
+            v = 1 - rz;
+            break;
+        case 4: // back
+            u = 1 - rx;
+            v = ry;
+            break;
+        default: // front
+            u = rx;
+            v = ry;
+            break;
+        }
+    }
+};
@@ -49,8 +49,29 @@ class bvh_node : public hittable {
         return hit_left || hit_right;
     }
 
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        if(!bbox.hit(r, ray_t))
+            return false;
+
+        return left->occluded(r, ray_t) || right->occluded(r, ray_t);
+    }
+
+    [[nodiscard]] double transmittance(const ray& r, interval ray_t) const override {
+        if(!bbox.hit(r, ray_t))
+            return 1;
+
+        auto fraction = left->transmittance(r, ray_t);
+        return fraction > 0 && right != left ? fraction * right->transmittance(r, ray_t) : fraction;
+    }
+
     [[nodiscard]] aabb bounding_box() const override { return bbox; }
 
+    void collect_lights(std::vector<const hittable*>& lights) const override {
+        left->collect_lights(lights);
+        if(right != left)
+            right->collect_lights(lights);
+    }
+
   private:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
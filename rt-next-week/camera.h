@@ -1,17 +1,27 @@
 #pragma once
 
 #include "color.h"
+#include "environment.h"
+#include "guiding.h"
 #include "hittable.h"
 #include "interval.h"
+#include "irradiance_cache.h"
+#include "light_list.h"
 #include "material.h"
+#include "pdf.h"
+#include "photon_map.h"
 #include "ray.h"
 #include "rtweekend.h"
 #include "thread-pool.h"
 #include "vec3.h"
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
 #include <fstream>
 #include <mutex>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
 
 class camera {
   public:
@@ -20,6 +30,7 @@ class camera {
     int samples_per_pixel = 10;
     int max_depth = 10;
     color background;
+    shared_ptr<const environment_light> environment; // if set, seen and sampled in place of background
 
     double vfov = 90;
     point3 lookfrom = point3(0, 0, 0);
@@ -29,8 +40,41 @@ class camera {
     double defocus_angle = 0;
     double focus_dist = 10;
 
+    // Paths traced together, each bounce scattered grouped by material. 1 traces every path on its own, which is
+    // as fast on the scenes here; grouping only pays once material and texture code is large enough to thrash the
+    // instruction cache between paths.
+    int batch_size = 1;
+
+    // Render in passes of 2, 4, 8, ... samples per pixel, learning from each pass where light arrives from and
+    // sampling the next partly in proportion to it. Every pass counts towards the image, weighted by the inverse of
+    // its estimated variance, so the early, barely guided passes count little.
+    bool path_guiding = false;
+
+    // Caustics through glass and mirrors from photon maps instead of paths (stochastic progressive photon
+    // mapping): the image is rendered in this many passes, each with fresh photons from the lights and a search
+    // radius shrinking from one pass to the next, so the bias fades as passes average. 0 traces caustics as paths.
+    int photon_passes = 0;
+    int photons_per_pass = 0; // 0: one per pixel
+    double photon_radius = 0; // of the first pass; 0 picks one from the first photons
+
+    // Indirect light at the first diffuse hit of each path interpolated from an irradiance cache instead of traced
+    // further, with this error bound (Ward's a, around 0.1 to 0.3). Direct light there is sampled alone. 0 traces
+    // every path to the end. The cache's error stays once it is built, so it pays at low sample counts: on the
+    // Cornell box, 0.3 beats path tracing in the same time up to about 32 samples per pixel, and loses beyond.
+    double irradiance_error = 0;
+    int irradiance_samples = 64; // paths gathered per cache record; gathering takes most of the cache's time
+
     void render(const hittable& world) {
         initialize();
+        lights = light_list(world, environment.get());
+        guide = path_guiding ? guiding_field(world.bounding_box()) : guiding_field();
+        photon_sources = photon_passes > 0 ? photon_tracer(world) : photon_tracer();
+        photon_radius_squared = photon_radius * photon_radius;
+        if(irradiance_error > 0) {
+            const auto& box = world.bounding_box();
+            auto diagonal = vec3(box.x.size(), box.y.size(), box.z.size()).length();
+            irradiance.reset(irradiance_error, 0.005 * diagonal, 0.1 * diagonal);
+        }
 
         std::ofstream myfile;
         std::stringstream buffer;
@@ -40,30 +84,50 @@ class camera {
         std::vector<color> pixels(image_width * image_height, color(0, 0, 0));
         lines_done = 0;
 
+        // Guided passes are summed on their own, with the squared luminance of their samples for the variance.
+        std::vector<color> pass_pixels(path_guiding ? pixels.size() : 0);
+        std::vector<double> pass_squares(pass_pixels.size());
+        auto& target = path_guiding ? pass_pixels : pixels;
+        double* squares = path_guiding ? pass_squares.data() : nullptr;
+        double weight_sum = 0;
+
         // Create one job per row instead of per sample
         print_status();
-        for(int j = 0; j < image_height; j++) {
-            threads.add_job([&world, &pixels, j, this] {
-                for(int i = 0; i < image_width; i++) {
-                    color pixel_color(0, 0, 0);
-                    for(int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, max_depth, world);
-                    }
-                    pixels[j * image_width + i] = pixel_color;
-                }
-                lines_done = lines_done + 1;
-                print_status();
-            });
-        }
+        int samples_done = 0;
+        for(int pass = 0; samples_done < samples_per_pixel; pass++) {
+            auto spp = pass_samples(pass, samples_done);
+            auto share = double(spp) / samples_per_pixel;
+            learning = path_guiding && samples_done + spp < samples_per_pixel;
+            if(!photon_sources.empty())
+                trace_photons(world, pass);
+            std::fill(pass_pixels.begin(), pass_pixels.end(), color(0, 0, 0));
+            std::fill(pass_squares.begin(), pass_squares.end(), 0.0);
+            for(int j = 0; j < image_height; j++) {
+                threads.add_job([&world, &target, squares, j, spp, share, this] {
+                    trace_row(j, spp, world, &target[j * image_width], squares ? squares + j * image_width : nullptr);
+                    lines_done = lines_done + share;
+                    print_status();
+                });
+            }
 
-        threads.wait_for_completion();
+            threads.wait_for_completion();
+            if(learning)
+                guide.finish_pass(spp);
+            if(path_guiding) {
+                auto weight = 1 / pass_variance(pass_pixels, pass_squares, spp);
+                for(size_t k = 0; k < pixels.size(); k++)
+                    pixels[k] += weight / spp * pass_pixels[k];
+                weight_sum += weight;
+            }
+            samples_done += spp;
+        }
         threads.end();
 
         // Write the image after all calculations are done
+        auto scale = path_guiding ? 1 / weight_sum : pixel_samples_scale;
         for(int j = 0; j < image_height; j++) {
             for(int i = 0; i < image_width; i++) {
-                write_color(buffer, pixel_samples_scale * pixels[j * image_width + i]);
+                write_color(buffer, scale * pixels[j * image_width + i]);
             }
         }
 
@@ -80,12 +144,28 @@ class camera {
     point3 pixel00_loc;
     vec3 pixel_delta_u;
     vec3 pixel_delta_v;
+    double pixel_spread; // angle a pixel subtends at the center of the image, which camera rays' cones start with
     vec3 u, v, w;
     vec3 defocus_disk_u;
     vec3 defocus_disk_v;
     thread_pool threads;
     std::mutex cam_mutex;
+    light_list lights; // built from the world at the start of render()
     std::atomic<double> lines_done{0};
+    guiding_field guide;
+    std::mutex guide_mutex;
+    bool learning = false; // whether the current pass records into guide
+
+    // Share of guided scattering directions; the rest come from the material, which keeps the estimate unbiased
+    // and covers directions the guide has not learned yet. Light sampling already covers the direct light the guide
+    // learns most of, so on the scenes here less than half does better.
+    static constexpr double guide_fraction = 0.3;
+
+    photon_tracer photon_sources;
+    photon_map photons;
+    double photon_radius_squared = 0;
+    bool photons_active = false; // whether this pass takes caustics from photons
+    mutable irradiance_cache irradiance; // filled in by shade() as paths need it
 
     void initialize() {
         image_height = int(image_width / aspect_ratio);
@@ -109,6 +189,7 @@ class camera {
 
         pixel_delta_u = viewport_u / image_width;
         pixel_delta_v = viewport_v / image_height;
+        pixel_spread = viewport_height / (image_height * focus_dist);
 
         auto viewport_upper_left = center - (focus_dist * w) - viewport_u / 2 - viewport_v / 2;
         pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
@@ -126,35 +207,516 @@ class camera {
         auto ray_direction = pixel_sample - ray_origin;
         auto ray_time = random_double();
 
-        return {ray_origin, ray_direction, ray_time};
+        return {ray_origin, ray_direction, real(ray_time)};
     }
 
-    [[nodiscard]] vec3 sample_square() const { return {random_double() - 0.5, random_double() - .5, 0}; }
+    [[nodiscard]] vec3 sample_square() const { return vec3(random_double() - 0.5, random_double() - .5, 0); }
 
     [[nodiscard]] point3 defocus_disk_sample() const {
         auto p = random_in_unit_disk();
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    [[nodiscard]] color ray_color(const ray& r, int depth, const hittable& world) const {
-        if(depth <= 0)
+    // Radiance learned along `direction` at p, divided by the density the direction was sampled with.
+    struct guide_record {
+        point3 p;
+        vec3 direction;
+        double value;
+    };
+
+    // A scattering vertex whose incident radiance is only known once its path ends: whatever the path gathers
+    // after it, divided by the throughput up to it.
+    struct guide_vertex {
+        point3 p;
+        vec3 direction;
+        color throughput;
+        color radiance;
+        double pdf;
+    };
+
+    struct guide_samples {
+        std::vector<guide_vertex> pending;
+        std::vector<guide_record> done;
+    };
+
+    // One path being traced: the ray it continues with and what it has gathered so far.
+    struct path {
+        path(const ray& r, int pixel, double spread = 0) : r(r), pixel(pixel), cone_spread(spread) {}
+
+        ray r;
+        int pixel;                          // column in the row
+        color throughput = color(1, 1, 1);
+        color radiance = color(0, 0, 0);
+        double scatter_pdf = 0;             // density r was scattered with; 0 for camera rays and specular bounces
+        point3 scatter_point;
+        const hittable* object = nullptr;   // what r hit, which identifies an emitter for the light density
+        guide_samples* learn = nullptr;     // where to record for guiding, in learning passes
+        bool diffuse_behind = false;        // the last non-delta bounce was off a diffuse surface
+        bool caustic = false;               // ... and delta bounces followed: an emitter found now is in the photons
+        bool light_sampled = false;         // the last hit sampled lights without MIS, leaving their emission out
+        bool may_cache = true;              // whether a diffuse hit may take its indirect light from the cache
+        double cone_spread;                 // angle by which the ray's cone widens per unit of distance
+        double cone_width = 0;              // width of the cone where r starts
+    };
+
+    // Scratch space for trace_batch, kept across the batches of a row.
+    struct batch_buffers {
+        std::vector<path> paths;
+        std::vector<hit_record> hits;
+        std::vector<scatter_sample> scatters;
+        std::vector<const direction_tree*> guides;
+        std::vector<char> scattered;
+        std::vector<std::uint32_t> active, hit_paths, hit_ids, group_start, grouped;
+        std::unordered_map<const material*, std::uint32_t> material_ids;
+    };
+
+    // Samples per pixel of a pass: doubling from 2, the fewest that give a variance, except that a pass which would
+    // leave less than twice itself takes all that is left, so the last (best guided) pass is the largest.
+    [[nodiscard]] int pass_samples(int pass, int samples_done) const {
+        auto left = samples_per_pixel - samples_done;
+        if(!path_guiding)
+            return photon_passes > 0 ? (left + photon_passes - pass - 1) / std::max(1, photon_passes - pass) : left;
+        auto spp = 2 << std::min(pass, 20);
+        return left - spp < 2 * spp ? left : spp;
+    }
+
+    // Variance of a pass's image, the mean over pixels of the variance of each pixel's average luminance, from the
+    // sums and squared sums of its `spp` samples. The floor keeps a black pass from getting an infinite weight.
+    [[nodiscard]] static double pass_variance(const std::vector<color>& sums, const std::vector<double>& squares,
+                                              int spp) {
+        if(spp < 2)
+            return 1;
+        double total = 0;
+        for(size_t k = 0; k < sums.size(); k++) {
+            auto sum = luminance(sums[k]);
+            total += std::fmax(0.0, squares[k] - sum * sum / spp) / (spp - 1) / spp;
+        }
+        return std::fmax(total / double(sums.size()), 1e-12);
+    }
+
+    // `spp` samples of every pixel in row j, batch_size paths at a time, summed into row and, if given, their
+    // squared luminance into squares. Learning passes trace paths one by one.
+    void trace_row(int j, int spp, const hittable& world, color* row, double* squares) {
+        const int total = image_width * spp;
+        const int batch = std::max(1, batch_size);
+
+        if(batch == 1 || learning) {
+            guide_samples samples;
+            if(learning)
+                samples.done.reserve(1 << 16);
+            for(int k = 0; k < total; k++) {
+                auto i = k / spp;
+                path p(get_ray(i, j), i, pixel_spread);
+                if(learning)
+                    p.learn = &samples;
+                trace_path(p, world, max_depth);
+                row[i] += p.radiance;
+                if(squares)
+                    squares[i] += luminance(p.radiance) * luminance(p.radiance);
+                if(learning) {
+                    resolve(p, samples);
+                    if(samples.done.size() >= 1 << 16 || k == total - 1)
+                        splat(samples);
+                }
+            }
+            return;
+        }
+
+        batch_buffers buffers;
+        for(int first = 0; first < total; first += batch) {
+            auto& paths = buffers.paths;
+            paths.clear();
+            for(int k = first; k < std::min(first + batch, total); k++) {
+                auto i = k / spp;
+                paths.emplace_back(get_ray(i, j), i, pixel_spread);
+            }
+
+            trace_batch(buffers, world);
+            for(const auto& p : paths) {
+                row[p.pixel] += p.radiance;
+                if(squares)
+                    squares[p.pixel] += luminance(p.radiance) * luminance(p.radiance);
+            }
+        }
+    }
+
+    // Path tracing with next-event estimation, bounce by bounce until the path escapes, is absorbed or runs out of
+    // depth.
+    void trace_path(path& p, const hittable& world, int depth) const {
+        for(; depth > 0; depth--) {
+            hit_record rec;
+            if(!world.hit(p.r, interval(surface_epsilon(p.r.origin()), infinity), rec)) {
+                p.radiance += p.throughput * escaped(p.r, p.scatter_pdf);
+                return;
+            }
+            p.object = rec.object;
+            rec.finalize(p.r);
+            widen_cone(p, rec);
+            if(!shade(p, rec, depth, world))
+                return;
+        }
+    }
+
+    // The same for a whole batch, one bounce at a time. All rays are intersected first. Then only the scattering
+    // is grouped by material: each material's sample() and texture code runs over a contiguous run instead of
+    // alternating from one path to the next. Emission, light sampling and shadow rays stay in path order, where
+    // neighbouring paths start close together.
+    void trace_batch(batch_buffers& b, const hittable& world) const {
+        auto& paths = b.paths;
+        auto& hits = b.hits;
+        hits.resize(paths.size());
+        b.scatters.resize(paths.size());
+        b.guides.resize(paths.size());
+        b.scattered.resize(paths.size());
+        b.active.resize(paths.size());
+        for(std::uint32_t k = 0; k < paths.size(); k++)
+            b.active[k] = k;
+
+        // Materials are numbered as they turn up; a counting sort on the number then groups the hits.
+        const material* last_material = nullptr; // neighbouring paths mostly hit the same material
+        std::uint32_t last_id = 0;
+
+        for(int depth = max_depth; depth > 0 && !b.active.empty(); depth--) {
+            b.hit_paths.clear();
+            b.hit_ids.clear();
+            for(auto k : b.active) {
+                auto& p = paths[k];
+                auto& rec = hits[k];
+                rec = hit_record();
+                if(!world.hit(p.r, interval(surface_epsilon(p.r.origin()), infinity), rec)) {
+                    p.radiance += p.throughput * escaped(p.r, p.scatter_pdf);
+                    continue;
+                }
+                p.object = rec.object;
+                rec.finalize(p.r);
+                widen_cone(p, rec);
+                add_emission(p, rec);
+                if(takes_cached(p, rec)) {
+                    add_cached(p, rec, world);
+                    continue;
+                }
+                if(rec.mat != last_material) {
+                    last_material = rec.mat;
+                    last_id = b.material_ids.emplace(rec.mat, std::uint32_t(b.material_ids.size())).first->second;
+                }
+                b.hit_paths.push_back(k);
+                b.hit_ids.push_back(last_id);
+            }
+
+            b.group_start.assign(b.material_ids.size() + 1, 0);
+            for(auto id : b.hit_ids)
+                b.group_start[id + 1]++;
+            for(size_t g = 1; g < b.group_start.size(); g++)
+                b.group_start[g] += b.group_start[g - 1];
+            b.grouped.resize(b.hit_paths.size());
+            for(size_t h = 0; h < b.hit_paths.size(); h++)
+                b.grouped[b.group_start[b.hit_ids[h]]++] = b.hit_paths[h];
+
+            for(auto k : b.grouped) {
+                b.guides[k] = guide_at(hits[k]);
+                b.scattered[k] = scatter(paths[k], hits[k], b.guides[k], b.scatters[k]);
+            }
+
+            // Back in path order for the light samples, keeping the survivors in that order.
+            b.active.clear();
+            for(auto k : b.hit_paths)
+                if(b.scattered[k] && continue_path(paths[k], hits[k], b.scatters[k], b.guides[k], depth, world))
+                    b.active.push_back(k);
+        }
+    }
+
+    // Adds what the hit emits and sends the path on. Emission is found two ways, by shadow rays towards sampled
+    // lights and by scattered rays, and the power heuristic weights each by how likely the other strategy was to
+    // find it. False when the path ends here.
+    bool shade(path& p, const hit_record& rec, int depth, const hittable& world) const {
+        add_emission(p, rec);
+        if(takes_cached(p, rec)) {
+            add_cached(p, rec, world);
+            return false;
+        }
+
+        const auto* guide_tree = guide_at(rec);
+        scatter_sample s;
+        return scatter(p, rec, guide_tree, s) && continue_path(p, rec, s, guide_tree, depth, world);
+    }
+
+    // What the hit emits, unless light sampling at the previous hit or the photons already account for it, and
+    // the caustics gathered from photons.
+    void add_emission(path& p, const hit_record& rec) const {
+        auto in_light_sample = p.light_sampled && lights.contains(p.object);
+        p.light_sampled = false;
+        if(!in_light_sample && (!p.caustic || !photon_sources.emits_photons(p.object))) {
+            color emitted = rec.mat->emitted(rec.u, rec.v, rec.p);
+            if(p.scatter_pdf > 0 && rec.mat->emits())
+                emitted = power_heuristic(p.scatter_pdf,
+                                          lights.pdf_value(p.scatter_point, p.r.direction(), p.object)) *
+                          emitted;
+            p.radiance += p.throughput * emitted;
+        }
+        if(photons_active && rec.mat->diffuse())
+            p.radiance += p.throughput * caustic_radiance(p.r, rec);
+    }
+
+    // Whether the path ends at this hit with its indirect light from the irradiance cache.
+    [[nodiscard]] bool takes_cached(const path& p, const hit_record& rec) const {
+        return irradiance_error > 0 && p.may_cache && rec.mat->diffuse();
+    }
+
+    void add_cached(path& p, const hit_record& rec, const hittable& world) const {
+        if(!lights.empty())
+            p.radiance += p.throughput * sample_light(p.r, rec, nullptr, world, p.learn, false);
+        p.radiance += p.throughput * rec.mat->eval(p.r, rec, rec.normal) * cached_irradiance(p.r, rec, world);
+    }
+
+    // Draws the scattered direction, by the guide if there is one; false when the path is absorbed.
+    bool scatter(const path& p, const hit_record& rec, const direction_tree* guide_tree, scatter_sample& s) const {
+        return guide_tree ? guided_sample(p.r, rec, *guide_tree, s) : rec.mat->sample(p.r, rec, s);
+    }
+
+    // Samples the lights from the hit and moves the path on along s. False when the path ends here.
+    bool continue_path(path& p, const hit_record& rec, const scatter_sample& s, const direction_tree* guide_tree,
+                       int depth, const hittable& world) const {
+        p.scatter_pdf = s.pdf;
+        p.scatter_point = rec.p;
+        if(photons_active) {
+            if(s.pdf > 0)
+                p.diffuse_behind = rec.mat->diffuse();
+            p.caustic = s.pdf <= 0 && p.diffuse_behind;
+        }
+        // The last bounce gets no light sample: its scattered ray is never traced, so the weights would not add up
+        // to one.
+        if(p.scatter_pdf > 0 && depth > 1 && !lights.empty())
+            p.radiance += p.throughput * sample_light(p.r, rec, guide_tree, world, p.learn);
+
+        p.throughput = p.throughput * s.weight;
+        p.r = s.scattered;
+        if(p.throughput.x() <= 0 && p.throughput.y() <= 0 && p.throughput.z() <= 0)
+            return false; // guided directions can fall where the material does not scatter
+        if(p.learn && s.pdf > 0)
+            p.learn->pending.push_back({rec.p, s.scattered.direction(), p.throughput, p.radiance, s.pdf});
+        return true;
+    }
+
+    // Carries p's ray cone out to the hit and sets the texture footprint there: the cone's width, stretched by the
+    // slant of the surface (the geometric mean of the ellipse's axes), in (u, v) units. The cone keeps its spread
+    // through every bounce; the curvature of mirrors and the blur of rough bounces are not followed.
+    static void widen_cone(path& p, hit_record& rec) {
+        auto length = p.r.direction().length();
+        p.cone_width += p.cone_spread * rec.t * length;
+        auto cosine = std::fabs(dot(p.r.direction(), rec.normal)) / length;
+        rec.footprint = rec.texture_scale * p.cone_width / std::sqrt(std::fmax(cosine, 1e-3));
+    }
+
+    // The learned distribution to guide scattering at a hit with, if any.
+    [[nodiscard]] const direction_tree* guide_at(const hit_record& rec) const {
+        if(!path_guiding || !rec.mat->guidable())
+            return nullptr;
+        return guide.sampling_at(rec.p);
+    }
+
+    // Scatters by the guide or the material, one-sample MIS over both: the weight divides by the mixed density.
+    bool guided_sample(const ray& r_in, const hit_record& rec, const direction_tree& tree, scatter_sample& s) const {
+        auto learned = guide_for(tree, rec);
+        material_pdf lobe(*rec.mat, r_in, rec);
+        mixture_pdf mix(learned, lobe, guide_fraction);
+        auto direction = mix.generate();
+        if(direction.near_zero())
+            return false;
+
+        s.scattered = ray(rec.spawn_origin(direction), direction, r_in.time());
+        s.pdf = mix.value(direction);
+        if(s.pdf <= 0)
+            return false;
+        s.weight = rec.mat->eval(r_in, rec, direction) / s.pdf;
+        return true;
+    }
+
+    // Density with which shade() scatters towards `direction`.
+    [[nodiscard]] static double scatter_density(const ray& r_in, const hit_record& rec, const direction_tree* tree,
+                                                const vec3& direction) {
+        material_pdf lobe(*rec.mat, r_in, rec);
+        if(!tree)
+            return lobe.value(direction);
+        auto learned = guide_for(*tree, rec);
+        return mixture_pdf(learned, lobe, guide_fraction).value(direction);
+    }
+
+    // Diffuse surfaces only scatter to the front; the media guided besides scatter all around.
+    static guide_pdf guide_for(const direction_tree& tree, const hit_record& rec) {
+        return rec.mat->diffuse() ? guide_pdf(tree, rec.normal) : guide_pdf(tree);
+    }
+
+    // Emission arriving along one light sample, times the BSDF and cosine, divided by its density and weighted
+    // against scattering.
+    [[nodiscard]] color sample_light(const ray& r_in, const hit_record& rec, const direction_tree* tree,
+                                     const hittable& world, guide_samples* learn, bool mis = true) const {
+        light_sample ls;
+        if(!lights.sample(rec.p, ls))
             return {0, 0, 0};
 
-        hit_record rec;
+        auto density = scatter_density(r_in, rec, tree, ls.direction);
+        if(density <= 0)
+            return {0, 0, 0};
 
-        if(!world.hit(r, interval(0.001, infinity), rec))
-            return background;
+        // Only the sampled light counts: what lies in front of it dims it (media) or blocks it (anything else), and
+        // its own density is accounted for when scattered rays find it.
+        ray shadow(rec.spawn_origin(ls.direction), ls.direction, r_in.time());
+        interval span(surface_epsilon(shadow.origin()), infinity);
+        auto weight = mis ? power_heuristic(ls.pdf, density) : 1.0;
+        color emitted;
+        if(!ls.light) {
+            emitted = environment->value(ls.direction);
+        } else {
+            hit_record light_rec;
+            if(!ls.light->hit(shadow, span, light_rec))
+                return {0, 0, 0};
+            light_rec.finalize(shadow);
+            // Stops short of the light itself, by the same margin rays leave surfaces with.
+            span.max = light_rec.t - surface_epsilon(light_rec.p) / shadow.direction().length();
+            emitted = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+        }
 
-        ray scattered;
-        color attenuation;
-        color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        auto through = world.transmittance(shadow, span);
+        if(through <= 0)
+            return {0, 0, 0};
+        emitted *= through;
 
-        if(!rec.mat->scatter(r, rec, attenuation, scattered))
-            return color_from_emission;
+        if(learn)
+            learn->done.push_back({rec.p, ls.direction, weight * luminance(emitted) / ls.pdf});
+        return weight / ls.pdf * rec.mat->eval(r_in, rec, ls.direction) * emitted;
+    }
 
-        color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
+    // Adds a row's records to the guide, under the lock: leaves are only split between passes, but their
+    // distributions are shared.
+    void splat(guide_samples& samples) {
+        std::lock_guard<std::mutex> lock(guide_mutex);
+        for(const auto& s : samples.done)
+            guide.record(s.p, s.direction, s.value);
+        samples.done.clear();
+    }
+
+    // Indirect irradiance at a diffuse hit, from the cache or from a new record gathered over the hemisphere. The
+    // record's paths leave out what light sampling at the hit covers: emission of the sampled lights and the
+    // environment.
+    color cached_irradiance(const ray& r_in, const hit_record& rec, const hittable& world) const {
+        color cached;
+        if(irradiance.lookup(rec.p, rec.normal, cached))
+            return cached;
+
+        std::array<vec3, 3> frame;
+        frame[2] = rec.normal;
+        frame[0] = unit_vector(cross(std::fabs(rec.normal.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0), rec.normal));
+        frame[1] = cross(rec.normal, frame[0]);
+
+        auto rings = std::max(2, int(std::lround(std::sqrt(irradiance_samples / pi))));
+        auto sectors = std::max(3, irradiance_samples / rings);
+        std::vector<color> radiance(rings * sectors);
+        std::vector<double> distance(rings * sectors), ring_offset(rings * sectors);
+        for(int j = 0; j < rings; j++) {
+            for(int k = 0; k < sectors; k++) {
+                auto index = j * sectors + k;
+                ring_offset[index] = random_double();
+                auto direction = irradiance_cache::stratum_direction(j, k, rings, sectors, ring_offset[index],
+                                                                     random_double(), frame);
+
+                // Each stratum covers pi / N of projected solid angle, about a cone 2 / sqrt(N) across.
+                path q(ray(rec.spawn_origin(direction), direction, r_in.time()), 0, 2 / std::sqrt(rings * sectors));
+                q.light_sampled = true;
+                q.may_cache = false;
+                q.diffuse_behind = photons_active;
+                hit_record h;
+                if(!world.hit(q.r, interval(surface_epsilon(q.r.origin()), infinity), h)) {
+                    radiance[index] = environment ? color(0, 0, 0) : background;
+                    distance[index] = infinity;
+                    continue;
+                }
+                distance[index] = h.t * q.r.direction().length();
+                q.object = h.object;
+                h.finalize(q.r);
+                widen_cone(q, h);
+                if(shade(q, h, max_depth, world))
+                    trace_path(q, world, max_depth - 1);
+                radiance[index] = q.radiance;
+            }
+        }
+
+        auto record = irradiance.gather(rec.p, frame, rings, sectors, radiance, distance, ring_offset);
+        irradiance.insert(record);
+        return record.irradiance;
+    }
+
+    // Turns the scattering vertices of a finished path into guide records.
+    static void resolve(const path& p, guide_samples& samples) {
+        for(const auto& v : samples.pending) {
+            auto gathered = p.radiance - v.radiance;
+            color incident;
+            for(int c = 0; c < 3; c++)
+                incident[c] = v.throughput[c] > 0 ? gathered[c] / v.throughput[c] : 0;
+            auto value = luminance(incident) / v.pdf;
+            if(value > 0)
+                samples.done.push_back({v.p, v.direction, value});
+        }
+        samples.pending.clear();
+    }
+
+    // Outgoing radiance due to the caustic photons around the hit: their power times the BSDF, over the area of
+    // the search disc.
+    [[nodiscard]] color caustic_radiance(const ray& r_in, const hit_record& rec) const {
+        color sum(0, 0, 0);
+        photons.gather(rec.p, [&](const photon& ph) {
+            auto cosine = -dot(ph.direction, rec.normal);
+            if(cosine > 0)
+                sum += ph.power * rec.mat->eval(r_in, rec, -ph.direction) / cosine;
+        });
+        return sum / (pi * photons.search_radius() * photons.search_radius());
+    }
+
+    // Traces this pass's photons on the thread pool into a new photon map. The first pass's radius comes from the
+    // photons if none was given; each later one shrinks its area by (i + alpha) / (i + 1), alpha = 2/3, after
+    // Knaus and Zwicker, "Progressive Photon Mapping: A Probabilistic Approach".
+    void trace_photons(const hittable& world, int pass) {
+        constexpr int jobs = 64;
+        const int count = photons_per_pass > 0 ? photons_per_pass : image_width * image_height;
+        std::vector<std::vector<photon>> stored(jobs);
+        for(int job = 0; job < jobs; job++) {
+            threads.add_job([&world, &stored, job, count, this] {
+                for(int k = job; k < count; k += jobs)
+                    photon_sources.trace(world, max_depth, count, stored[job]);
+            });
+        }
+        threads.wait_for_completion();
+
+        std::vector<photon> all;
+        for(auto& job : stored)
+            all.insert(all.end(), job.begin(), job.end());
+
+        if(pass > 0 && photon_radius_squared > 0)
+            photon_radius_squared *= (pass + 2.0 / 3) / (pass + 1);
+        if(photon_radius_squared <= 0) {
+            auto r = photon_map::suggest_radius(all);
+            photon_radius_squared = r * r;
+        }
+
+        // Until a radius is known, caustics are traced as paths.
+        photons_active = photon_radius_squared > 0;
+        photons = photons_active ? photon_map(std::move(all), std::sqrt(photon_radius_squared)) : photon_map();
+    }
+
+    // Radiance along a ray that leaves the scene, weighted against light sampling if the environment could have
+    // been sampled.
+    [[nodiscard]] color escaped(const ray& r, double scatter_pdf) const {
+        if(!environment)
+            return background;
+
+        auto sky = environment->value(r.direction());
+        if(scatter_pdf > 0)
+            sky = power_heuristic(scatter_pdf, lights.environment_pdf(r.direction())) * sky;
+        return sky;
+    }
 
-        return color_from_emission + color_from_scatter;
+    static double power_heuristic(double pdf, double other_pdf) {
+        auto a = pdf * pdf;
+        return a / (a + other_pdf * other_pdf);
     }
 
     void print_status() {
@@ -7,6 +7,9 @@
 
 using color = vec3;
 
+// Relative luminance of linear sRGB.
+inline double luminance(const color& c) { return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z(); }
+
 inline double linear_to_gamma(double linear_component) {
     if(linear_component > 0)
         return std::sqrt(linear_component);
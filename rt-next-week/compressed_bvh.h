@@ -0,0 +1,732 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "interval.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Order of the flattened nodes in memory. The tree shape is the same for all three; only locality differs.
+enum class bvh_layout { depth_first, van_emde_boas, treelet };
+
+inline const char* layout_name(bvh_layout layout) {
+    switch(layout) {
+    case bvh_layout::depth_first:
+        return "depth-first";
+    case bvh_layout::van_emde_boas:
+        return "van Emde Boas";
+    case bvh_layout::treelet:
+        return "treelet";
+    }
+    return "?";
+}
+
+// Set-associative LRU model of a data cache, used to estimate how many node fetches of a traversal would miss.
+class cache_model {
+  public:
+    static constexpr size_t line_bytes = 64;
+
+    cache_model(size_t cache_bytes = 32 * 1024, size_t ways = 8)
+        : ways(ways), sets(cache_bytes / line_bytes / ways), tags(sets * ways, no_line), ages(sets * ways, 0) {}
+
+    // Touches every line the byte range [offset, offset + size) spans.
+    void access(size_t offset, size_t size) {
+        for(auto line = offset / line_bytes; line <= (offset + size - 1) / line_bytes; line++)
+            touch(line);
+    }
+
+    [[nodiscard]] size_t misses() const { return miss_count; }
+
+  private:
+    static constexpr size_t no_line = ~size_t(0);
+
+    size_t ways;
+    size_t sets;
+    std::vector<size_t> tags;
+    std::vector<size_t> ages;
+    size_t clock = 0;
+    size_t miss_count = 0;
+
+    void touch(size_t line) {
+        auto base = (line % sets) * ways;
+        auto victim = base;
+        clock++;
+        for(auto i = base; i < base + ways; i++) {
+            if(tags[i] == line) {
+                ages[i] = clock;
+                return;
+            }
+            if(ages[i] < ages[victim])
+                victim = i;
+        }
+        miss_count++;
+        tags[victim] = line;
+        ages[victim] = clock;
+    }
+};
+
+// Allocates on cache line boundaries, so that node offsets within an array are also offsets within lines.
+template <typename T> struct line_aligned_allocator {
+    using value_type = T;
+
+    line_aligned_allocator() = default;
+    template <typename U> line_aligned_allocator(const line_aligned_allocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(cache_model::line_bytes)));
+    }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(cache_model::line_bytes)); }
+
+    template <typename U> bool operator==(const line_aligned_allocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const line_aligned_allocator<U>&) const { return false; }
+};
+
+// Flattened BVH whose nodes store both child boxes quantized to Q-bit integers relative to the (decoded) box of the
+// node itself. Decoding always rounds outwards, so a decoded box never misses anything the exact box would hit.
+template <typename Q = std::uint8_t>
+class quantized_bvh {
+  public:
+    static constexpr std::uint32_t leaf_flag = 0x80000000u;
+    static constexpr std::uint32_t max_leaf_size = 16;
+
+    struct node {
+        std::array<std::array<Q, 3>, 2> qmin;
+        std::array<std::array<Q, 3>, 2> qmax;
+        // Inner child: node index. Leaf child: leaf_flag | (count - 1) << 27 | first primitive.
+        std::array<std::uint32_t, 2> child;
+    };
+
+    void build(const std::vector<aabb>& prim_boxes) {
+        nodes.clear();
+        order.resize(prim_boxes.size());
+        for(std::uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+
+        root_box = aabb::empty;
+        for(const auto& b : prim_boxes)
+            root_box = aabb(root_box, b);
+
+        if(prim_boxes.empty()) {
+            root = leaf_flag;
+            return;
+        }
+
+        nodes.reserve(prim_boxes.size());
+        root = build_recursive(prim_boxes, 0, order.size(), root_box, 0);
+    }
+
+    // Takes over a tree saved from node_array(), root_ref(), primitive_order() and bounds() of a built tree, without
+    // rebuilding it. The arrays are copied; they can point straight into a mapped file.
+    void restore(std::uint32_t root_ref, const aabb& bounds, const node* first_node, size_t count,
+                 const std::uint32_t* prim_order, size_t prim_count) {
+        nodes.assign(first_node, first_node + count);
+        order.assign(prim_order, prim_order + prim_count);
+        root = root_ref;
+        root_box = bounds;
+    }
+
+    // Whether arrays for restore() describe a tree traversal can walk safely: every node reached from the root once,
+    // children and leaf ranges in bounds and no leaf deeper than the traversal stack. For arrays read from a file.
+    [[nodiscard]] static bool well_formed(std::uint32_t root_ref, const node* first_node, size_t count,
+                                          size_t prim_count) {
+        if(prim_count == 0)
+            return root_ref == leaf_flag;
+
+        std::vector<bool> reached(count, false);
+        std::vector<std::pair<std::uint32_t, int>> pending = {{root_ref, 0}};
+        while(!pending.empty()) {
+            auto [ref, depth] = pending.back();
+            pending.pop_back();
+            if(depth > max_depth)
+                return false;
+            if(ref & leaf_flag) {
+                if(size_t(leaf_first(ref)) + leaf_count(ref) > prim_count)
+                    return false;
+                continue;
+            }
+            if(ref >= count || reached[ref])
+                return false;
+            reached[ref] = true;
+            for(auto c : first_node[ref].child)
+                pending.push_back({c, depth + 1});
+        }
+        return true;
+    }
+
+    [[nodiscard]] const aabb& bounds() const { return root_box; }
+    [[nodiscard]] const std::vector<std::uint32_t>& primitive_order() const { return order; }
+    [[nodiscard]] const std::vector<node, line_aligned_allocator<node>>& node_array() const { return nodes; }
+
+    // Calls leaf(first, count) once for every leaf, with the range it covers in primitive_order().
+    template <typename Leaf> void for_each_leaf(Leaf&& leaf) const {
+        if(order.empty())
+            return;
+
+        std::vector<std::uint32_t> pending = {root};
+        while(!pending.empty()) {
+            auto ref = pending.back();
+            pending.pop_back();
+            if(ref & leaf_flag)
+                leaf(leaf_first(ref), leaf_count(ref));
+            else
+                pending.insert(pending.end(), nodes[ref].child.begin(), nodes[ref].child.end());
+        }
+    }
+    [[nodiscard]] std::uint32_t root_ref() const { return root; }
+    [[nodiscard]] size_t node_count() const { return nodes.size(); }
+    [[nodiscard]] size_t memory_bytes() const {
+        return nodes.size() * sizeof(node) + order.size() * sizeof(std::uint32_t);
+    }
+
+    // Reorders the node array. Treelet layout packs each node with its most likely successors into one cache line,
+    // padding with unused nodes wherever a node would straddle two lines.
+    void relayout(bvh_layout layout) {
+        if(nodes.empty())
+            return;
+
+        std::vector<std::uint32_t> sequence;
+        sequence.reserve(nodes.size());
+        switch(layout) {
+        case bvh_layout::depth_first:
+            layout_depth_first(root, sequence);
+            break;
+        case bvh_layout::van_emde_boas:
+            layout_van_emde_boas(root, height(root), sequence);
+            break;
+        case bvh_layout::treelet:
+            layout_treelets(sequence);
+            break;
+        }
+
+        std::vector<std::uint32_t> new_index(nodes.size(), padding);
+        for(std::uint32_t i = 0; i < sequence.size(); i++)
+            if(sequence[i] != padding)
+                new_index[sequence[i]] = i;
+
+        auto remap = [&](std::uint32_t ref) { return (ref & leaf_flag) ? ref : new_index[ref]; };
+
+        std::vector<node, line_aligned_allocator<node>> reordered(sequence.size(), node{});
+        for(size_t i = 0; i < sequence.size(); i++) {
+            if(sequence[i] == padding)
+                continue;
+            reordered[i] = nodes[sequence[i]];
+            for(auto& c : reordered[i].child)
+                c = remap(c);
+        }
+
+        root = remap(root);
+        nodes = std::move(reordered);
+    }
+
+    // Calls leaf(first, count, ray_t) for every leaf the ray reaches, nearest first. The callback returns true when
+    // it found a hit and is expected to have shrunk ray_t.max to it.
+    template <typename Leaf>
+    bool traverse(const ray& r, interval ray_t, Leaf&& leaf) const {
+        return traverse(r, ray_t, std::forward<Leaf>(leaf), [](std::uint32_t) {});
+    }
+
+    // Any-hit variant: stops at the first leaf that reports a hit.
+    template <typename Leaf>
+    bool traverse_any(const ray& r, interval ray_t, Leaf&& leaf) const {
+        return traverse<true>(r, ray_t, std::forward<Leaf>(leaf), [](std::uint32_t) {});
+    }
+
+    // As above, additionally reporting the index of every inner node that gets fetched.
+    template <bool any_hit = false, typename Leaf, typename Visit>
+    bool traverse(const ray& r, interval ray_t, Leaf&& leaf, Visit&& visit) const {
+        if(order.empty())
+            return false;
+
+        const point3& orig = r.origin();
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+
+        // Plain-old-data entries: the stack is deliberately left uninitialized.
+        struct entry {
+            std::uint32_t ref;
+            real tnear;
+            node_box box;
+        };
+        // Only siblings of the current node's ancestors are stacked, so the build's depth cap bounds it.
+        std::array<entry, max_depth + 1> stack;
+        int sp = 0;
+
+        real tnear;
+        node_box box = to_node_box(root_box);
+        if(!slab(box, orig, inv_dir, ray_t, tnear))
+            return false;
+
+        // Descend straight into the nearer child and only stack the farther one.
+        std::uint32_t ref = root;
+        bool hit_anything = false;
+        while(true) {
+            if(ref & leaf_flag) {
+                if(leaf(leaf_first(ref), leaf_count(ref), ray_t)) {
+                    if constexpr(any_hit)
+                        return true;
+                    hit_anything = true;
+                }
+            } else {
+                visit(ref);
+                const node& n = nodes[ref];
+                std::array<node_box, 2> boxes = {decode(box, n, 0), decode(box, n, 1)};
+                std::array<real, 2> t;
+                std::array<bool, 2> hit = {slab(boxes[0], orig, inv_dir, ray_t, t[0]),
+                                           slab(boxes[1], orig, inv_dir, ray_t, t[1])};
+
+                if(hit[0] || hit[1]) {
+                    int near = (!hit[0] || (hit[1] && t[1] < t[0])) ? 1 : 0;
+                    int far = 1 - near;
+                    if(hit[far])
+                        stack[sp++] = {n.child[far], t[far], boxes[far]};
+                    ref = n.child[near];
+                    box = boxes[near];
+                    continue;
+                }
+            }
+
+            while(sp > 0 && stack[sp - 1].tnear >= ray_t.max)
+                sp--;
+            if(sp == 0)
+                break;
+            sp--;
+            ref = stack[sp].ref;
+            box = stack[sp].box;
+        }
+
+        return hit_anything;
+    }
+
+  private:
+    static constexpr real qscale = std::numeric_limits<Q>::max();
+    static constexpr real inv_qscale = 1 / qscale;
+    static constexpr int bin_count = 12;
+    static constexpr int max_depth = 63; // of any leaf, which sizes the traversal stack
+    static constexpr std::uint32_t padding = ~std::uint32_t(0);
+
+    std::vector<node, line_aligned_allocator<node>> nodes;
+    std::vector<std::uint32_t> order;
+    std::uint32_t root = leaf_flag;
+    aabb root_box;
+
+    static std::uint32_t leaf_first(std::uint32_t ref) { return ref & 0x07ffffffu; }
+    static std::uint32_t leaf_count(std::uint32_t ref) { return ((ref >> 27) & 0xfu) + 1; }
+    static std::uint32_t make_leaf(size_t first, size_t count) {
+        return leaf_flag | std::uint32_t((count - 1) << 27) | std::uint32_t(first);
+    }
+
+    struct node_box {
+        std::array<real, 3> lo, hi;
+    };
+
+    static node_box to_node_box(const aabb& box) {
+        return {{box.x.min, box.y.min, box.z.min}, {box.x.max, box.y.max, box.z.max}};
+    }
+
+    // Builds an aabb without the minimum padding, so decoded boxes stay bit-identical between build and traversal.
+    static aabb to_aabb(const node_box& b) {
+        aabb box;
+        box.x = interval(b.lo[0], b.hi[0]);
+        box.y = interval(b.lo[1], b.hi[1]);
+        box.z = interval(b.lo[2], b.hi[2]);
+        return box;
+    }
+
+    static bool slab(const node_box& box, const point3& orig, const vec3& inv_dir, const interval& ray_t,
+                     real& tnear) {
+        real tmin = ray_t.min;
+        real tmax = ray_t.max;
+        // Branch-free: the near/far choice per axis is a min/max rather than a data-dependent swap.
+        for(int axis = 0; axis < 3; axis++) {
+            auto t0 = (box.lo[axis] - orig[axis]) * inv_dir[axis];
+            auto t1 = (box.hi[axis] - orig[axis]) * inv_dir[axis];
+            auto near = t0 < t1 ? t0 : t1;
+            auto far = (t0 < t1 ? t1 : t0) * aabb::far_scale;
+            tmin = near > tmin ? near : tmin;
+            tmax = far < tmax ? far : tmax;
+        }
+        tnear = tmin;
+        return tmin < tmax;
+    }
+
+    static node_box decode(const node_box& parent, const node& n, int c) {
+        node_box b;
+        for(int axis = 0; axis < 3; axis++) {
+            auto step = (parent.hi[axis] - parent.lo[axis]) * inv_qscale;
+            b.lo[axis] = parent.lo[axis] + n.qmin[c][axis] * step;
+            b.hi[axis] = parent.lo[axis] + n.qmax[c][axis] * step;
+        }
+        return b;
+    }
+
+    static void encode(const aabb& parent, const aabb& child, node& n, int c) {
+        for(int axis = 0; axis < 3; axis++) {
+            const interval& p = parent.axis_interval(axis);
+            const interval& ch = child.axis_interval(axis);
+            auto step = p.size() * inv_qscale;
+            if(step <= 0) {
+                n.qmin[c][axis] = 0;
+                n.qmax[c][axis] = Q(qscale);
+                continue;
+            }
+
+            auto lo = std::floor((ch.min - p.min) / step);
+            auto hi = std::ceil((ch.max - p.min) / step);
+            lo = interval(0, qscale).clamp(lo);
+            hi = interval(0, qscale).clamp(hi);
+
+            // Floating point rounding may still land a hair inside the exact box; step outwards until it doesn't.
+            while(lo > 0 && p.min + lo * step > ch.min)
+                lo -= 1;
+            while(hi < qscale && p.min + hi * step < ch.max)
+                hi += 1;
+
+            n.qmin[c][axis] = Q(lo);
+            n.qmax[c][axis] = Q(hi);
+        }
+    }
+
+    static point3 centroid(const aabb& b) {
+        return point3(0.5 * (b.x.min + b.x.max), 0.5 * (b.y.min + b.y.max), 0.5 * (b.z.min + b.z.max));
+    }
+
+    static double surface_area(const aabb& b) {
+        if(b.x.size() < 0 || b.y.size() < 0 || b.z.size() < 0)
+            return 0;
+        return 2 * (b.x.size() * b.y.size() + b.y.size() * b.z.size() + b.z.size() * b.x.size());
+    }
+
+    // Levels of median splits below a node of `span` primitives until every leaf fits max_leaf_size.
+    static int median_levels(size_t span) {
+        int levels = 0;
+        for(; span > max_leaf_size; span = (span + 1) / 2)
+            levels++;
+        return levels;
+    }
+
+    int height(std::uint32_t ref) const {
+        if(ref & leaf_flag)
+            return 0;
+        return 1 + std::max(height(nodes[ref].child[0]), height(nodes[ref].child[1]));
+    }
+
+    void layout_depth_first(std::uint32_t ref, std::vector<std::uint32_t>& sequence) const {
+        if(ref & leaf_flag)
+            return;
+        sequence.push_back(ref);
+        layout_depth_first(nodes[ref].child[0], sequence);
+        layout_depth_first(nodes[ref].child[1], sequence);
+    }
+
+    // Lays out the top `levels` levels below ref: the upper half recursively, then each lower-half subtree.
+    void layout_van_emde_boas(std::uint32_t ref, int levels, std::vector<std::uint32_t>& sequence) const {
+        if((ref & leaf_flag) || levels <= 0)
+            return;
+        if(levels == 1) {
+            sequence.push_back(ref);
+            return;
+        }
+
+        int top = levels / 2;
+        layout_van_emde_boas(ref, top, sequence);
+
+        std::vector<std::uint32_t> frontier = {ref};
+        for(int level = 0; level < top; level++) {
+            std::vector<std::uint32_t> next;
+            for(auto f : frontier)
+                for(auto c : nodes[f].child)
+                    if(!(c & leaf_flag))
+                        next.push_back(c);
+            frontier = std::move(next);
+        }
+        for(auto f : frontier)
+            layout_van_emde_boas(f, levels - top, sequence);
+    }
+
+    // Greedy treelets: grow each one from its root by always adding the pending node with the largest subtree, as
+    // long as the nodes still fit whole in the current cache line, then start new treelets at the children left
+    // outside, in depth-first order. Slots that would straddle a line boundary are left as padding, so with the
+    // array line-aligned every treelet sits in a single line.
+    void layout_treelets(std::vector<std::uint32_t>& sequence) const {
+        constexpr size_t line = cache_model::line_bytes;
+        // Whole nodes from slot i to the end of its line; 0 if slot i straddles the boundary.
+        auto room = [](size_t i) {
+            auto offset = i * sizeof(node) % line;
+            return offset + sizeof(node) > line ? 0 : (line - offset) / sizeof(node);
+        };
+
+        std::vector<std::uint32_t> subtree_size(nodes.size(), 0);
+        for(auto i = nodes.size(); i-- > 0;) {
+            subtree_size[i] = 1;
+            for(auto c : nodes[i].child)
+                if(!(c & leaf_flag))
+                    subtree_size[i] += subtree_size[c];
+        }
+
+        std::vector<std::uint32_t> roots = {root};
+        while(!roots.empty()) {
+            auto treelet_root = roots.back();
+            roots.pop_back();
+
+            while(room(sequence.size()) == 0)
+                sequence.push_back(padding);
+            auto capacity = room(sequence.size());
+
+            std::vector<std::uint32_t> pending = {treelet_root};
+            for(size_t placed = 0; placed < capacity && !pending.empty(); placed++) {
+                auto best = std::max_element(pending.begin(), pending.end(), [&](std::uint32_t a, std::uint32_t b) {
+                    return subtree_size[a] < subtree_size[b];
+                });
+                sequence.push_back(*best);
+                auto n = *best;
+                pending.erase(best);
+                for(auto c : nodes[n].child)
+                    if(!(c & leaf_flag))
+                        pending.push_back(c);
+            }
+
+            for(auto it = pending.rbegin(); it != pending.rend(); ++it)
+                roots.push_back(*it);
+        }
+    }
+
+    // Returns the child reference for the primitive range [start, end), which `box` (as decoded) encloses.
+    std::uint32_t build_recursive(const std::vector<aabb>& prim_boxes, size_t start, size_t end, const aabb& box,
+                                  int depth) {
+        size_t span = end - start;
+        if(span <= 2)
+            return make_leaf(start, span);
+
+        aabb centroid_box = aabb::empty;
+        for(size_t i = start; i < end; i++) {
+            auto c = centroid(prim_boxes[order[i]]);
+            centroid_box = aabb(centroid_box, aabb(c, c));
+        }
+        int axis = centroid_box.longest_axis();
+        const interval& extent = centroid_box.axis_interval(axis);
+
+        size_t mid = start + span / 2;
+        bool make_leaf_here = false;
+        bool median_split = true;
+
+        // SAH splits may be lopsided; once only median splits would still reach leaves of max_leaf_size within
+        // max_depth, only those are made.
+        if(extent.size() <= 0 || depth + 1 + median_levels(span) > max_depth) {
+            make_leaf_here = span <= max_leaf_size;
+        } else {
+            // Binned surface area heuristic along the longest centroid axis.
+            std::array<aabb, bin_count> bin_box;
+            std::array<size_t, bin_count> bin_n{};
+            bin_box.fill(aabb::empty);
+            auto bin_of = [&](std::uint32_t prim) {
+                auto b = int(bin_count * (centroid(prim_boxes[prim])[axis] - extent.min) / extent.size());
+                return b < 0 ? 0 : (b >= bin_count ? bin_count - 1 : b);
+            };
+            for(size_t i = start; i < end; i++) {
+                int b = bin_of(order[i]);
+                bin_n[b]++;
+                bin_box[b] = aabb(bin_box[b], prim_boxes[order[i]]);
+            }
+
+            std::array<double, bin_count - 1> cost;
+            aabb acc = aabb::empty;
+            size_t acc_n = 0;
+            for(int b = 0; b < bin_count - 1; b++) {
+                acc = aabb(acc, bin_box[b]);
+                acc_n += bin_n[b];
+                cost[b] = acc_n * surface_area(acc);
+            }
+            acc = aabb::empty;
+            acc_n = 0;
+            for(int b = bin_count - 1; b > 0; b--) {
+                acc = aabb(acc, bin_box[b]);
+                acc_n += bin_n[b];
+                cost[b - 1] += acc_n * surface_area(acc);
+            }
+
+            int best = 0;
+            for(int b = 1; b < bin_count - 1; b++)
+                if(cost[b] < cost[best])
+                    best = b;
+
+            auto leaf_cost = span * surface_area(box);
+            auto split_cost = 0.125 * surface_area(box) + cost[best];
+            if(span <= 4 && leaf_cost <= split_cost) {
+                make_leaf_here = true;
+            } else {
+                auto it = std::partition(order.begin() + start, order.begin() + end,
+                                         [&](std::uint32_t prim) { return bin_of(prim) <= best; });
+                auto sah_mid = size_t(it - order.begin());
+                if(sah_mid != start && sah_mid != end) {
+                    mid = sah_mid;
+                    median_split = false;
+                }
+            }
+        }
+
+        if(make_leaf_here)
+            return make_leaf(start, span);
+
+        if(median_split) {
+            std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                             [&](std::uint32_t a, std::uint32_t b) {
+                                 return centroid(prim_boxes[a])[axis] < centroid(prim_boxes[b])[axis];
+                             });
+        }
+
+        std::array<aabb, 2> child_box = {aabb::empty, aabb::empty};
+        for(size_t i = start; i < mid; i++)
+            child_box[0] = aabb(child_box[0], prim_boxes[order[i]]);
+        for(size_t i = mid; i < end; i++)
+            child_box[1] = aabb(child_box[1], prim_boxes[order[i]]);
+
+        auto index = std::uint32_t(nodes.size());
+        nodes.emplace_back();
+
+        // Children are quantized against the decoded box the traversal will reconstruct, and their subtrees are in
+        // turn built against their own decoded boxes.
+        for(int c = 0; c < 2; c++) {
+            encode(box, child_box[c], nodes[index], c);
+            auto decoded = to_aabb(decode(to_node_box(box), nodes[index], c));
+            auto ref = (c == 0) ? build_recursive(prim_boxes, start, mid, decoded, depth + 1)
+                                : build_recursive(prim_boxes, mid, end, decoded, depth + 1);
+            nodes[index].child[c] = ref;
+        }
+
+        return index;
+    }
+};
+
+template <typename Q = std::uint8_t>
+class compressed_bvh : public hittable {
+  public:
+    compressed_bvh(const hittable_list& list) : compressed_bvh(list.objects) {}
+
+    compressed_bvh(const std::vector<shared_ptr<hittable>>& objects) {
+        std::vector<aabb> boxes;
+        boxes.reserve(objects.size());
+        for(const auto& object : objects)
+            boxes.push_back(object->bounding_box());
+
+        tree.build(boxes);
+
+        primitives.reserve(objects.size());
+        for(auto index : tree.primitive_order())
+            primitives.push_back(objects[index]);
+    }
+
+    // Over a tree built earlier (see quantized_bvh::restore); `ordered` must already be in the tree's leaf order.
+    compressed_bvh(quantized_bvh<Q> prebuilt, std::vector<shared_ptr<hittable>> ordered)
+        : tree(std::move(prebuilt)), primitives(std::move(ordered)) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return tree.traverse(r, ray_t, leaf_hit(r, rec));
+    }
+
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        return tree.traverse_any(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            for(auto i = first; i < first + count; i++)
+                if(primitives[i]->occluded(r, t))
+                    return true;
+            return false;
+        });
+    }
+
+    // Every leaf along the ray multiplies in; an opaque one ends the traversal.
+    [[nodiscard]] double transmittance(const ray& r, interval ray_t) const override {
+        double fraction = 1;
+        tree.traverse_any(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            for(auto i = first; i < first + count && fraction > 0; i++)
+                fraction *= primitives[i]->transmittance(r, t);
+            return fraction <= 0;
+        });
+        return fraction;
+    }
+
+    [[nodiscard]] aabb bounding_box() const override { return tree.bounds(); }
+
+    void collect_lights(std::vector<const hittable*>& lights) const override {
+        for(const auto& primitive : primitives)
+            primitive->collect_lights(lights);
+    }
+
+    // Node memory of this tree next to what the same primitives would cost as a tree of bvh_node objects (one
+    // make_shared allocation per inner node: object plus the in-place control block).
+    void print_stats(std::ostream& out) const {
+        auto inner = primitives.empty() ? 0 : primitives.size() - 1;
+        auto pointer_tree_bytes = inner * (sizeof(bvh_node) + control_block_bytes);
+        out << "compressed_bvh<" << 8 * sizeof(Q) << ">: " << primitives.size() << " primitives, " << tree.node_count()
+            << " nodes, " << tree.memory_bytes() << " bytes (" << sizeof(typename quantized_bvh<Q>::node)
+            << " B/node); bvh_node tree: ~" << pointer_tree_bytes << " bytes\n";
+    }
+
+    void set_layout(bvh_layout layout) { tree.relayout(layout); }
+
+    // Average number of node cache lines per ray that miss in a modelled L1 cache, with the cache kept warm across
+    // the rays in order (pass them in the order the renderer would trace them).
+    [[nodiscard]] double cache_misses_per_ray(const std::vector<ray>& rays) const {
+        if(rays.empty())
+            return 0;
+
+        cache_model cache;
+        constexpr size_t node_bytes = sizeof(typename quantized_bvh<Q>::node);
+        for(const auto& r : rays) {
+            hit_record rec;
+            tree.traverse(r, interval(0.001, infinity), leaf_hit(r, rec),
+                          [&](std::uint32_t index) { cache.access(index * node_bytes, node_bytes); });
+        }
+        return double(cache.misses()) / double(rays.size());
+    }
+
+    // Tries every layout against the sample rays, reports the misses per ray and keeps the best one.
+    bvh_layout choose_layout(const std::vector<ray>& sample_rays, std::ostream& out) {
+        auto best = bvh_layout::depth_first;
+        auto best_misses = infinity;
+        for(auto layout : {bvh_layout::depth_first, bvh_layout::van_emde_boas, bvh_layout::treelet}) {
+            tree.relayout(layout);
+            auto misses = cache_misses_per_ray(sample_rays);
+            out << "compressed_bvh<" << 8 * sizeof(Q) << "> " << layout_name(layout) << " layout: " << misses
+                << " node cache misses/ray\n";
+            if(misses < best_misses) {
+                best_misses = misses;
+                best = layout;
+            }
+        }
+        tree.relayout(best);
+        return best;
+    }
+
+  private:
+    static constexpr size_t control_block_bytes = 16;
+
+    auto leaf_hit(const ray& r, hit_record& rec) const {
+        return [this, &r, &rec](std::uint32_t first, std::uint32_t count, interval& t) {
+            bool hit_anything = false;
+            for(auto i = first; i < first + count; i++) {
+                if(primitives[i]->hit(r, t, rec)) {
+                    hit_anything = true;
+                    t.max = rec.t;
+                }
+            }
+            return hit_anything;
+        };
+    }
+
+    quantized_bvh<Q> tree;
+    std::vector<shared_ptr<hittable>> primitives;
+};
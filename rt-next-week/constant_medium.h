@@ -14,48 +14,47 @@ class constant_medium : public hittable {
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        interval_list spans;
+        boundary->inside(r, ray_t, spans);
 
-        hit_record rec1, rec2;
-
-        if(!boundary->hit(r, interval::universe, rec1)) {
-            return false;
-        }
+        // Free-flight distance through the medium, spent across the spans in order.
+        auto ray_length = r.direction().length();
+        auto hit_distance = neg_inv_density * std::log(random_double(0.0001, 1.0));
 
-        if(!boundary->hit(r, interval(rec1.t + 0.0001, infinity), rec2)) {
-            return false;
-        }
+        for(const auto& span : spans) {
+            auto distance_inside_boundary = span.size() * ray_length;
+            if(hit_distance <= distance_inside_boundary) {
+                rec.t = span.min + hit_distance / ray_length;
+                rec.p = r.at(rec.t);
 
-        if(rec1.t < ray_t.min)
-            rec1.t = ray_t.min;
-        if(rec2.t > ray_t.max)
-            rec2.t = ray_t.max;
+                rec.normal = vec3(1, 0, 0); // arbitrary
+                rec.front_face = true;      // also arbitrary
+                rec.mat = phase_function.get();
+                rec.object = nullptr;
 
-        if(rec1.t >= rec2.t) {
-            return false;
+                return true;
+            }
+            hit_distance -= distance_inside_boundary;
         }
 
-        if(rec1.t < 0)
-            rec1.t = 0;
-
-        auto ray_length = r.direction().length();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-        auto hit_distance = neg_inv_density * std::log(random_double(0.0001, 1.0));
-
-        if(hit_distance > distance_inside_boundary)
-            return false;
-
-        rec.t = rec1.t + hit_distance / ray_length;
-        rec.p = r.at(rec.t);
+        return false;
+    }
 
-        rec.normal = vec3(1, 0, 0); // arbitrary
-        rec.front_face = true;      // also arbitrary
-        rec.mat = phase_function;
+    // Exact: the medium is uniform, so only the length of the ray inside the boundary matters.
+    [[nodiscard]] double transmittance(const ray& r, interval ray_t) const override {
+        interval_list spans;
+        boundary->inside(r, ray_t, spans);
 
-        return true;
+        double distance = 0;
+        for(const auto& span : spans)
+            distance += span.size();
+        return std::exp(distance * r.direction().length() / neg_inv_density);
     }
 
     [[nodiscard]] aabb bounding_box() const override { return boundary->bounding_box(); }
 
+    [[nodiscard]] aabb bounding_box_at(double time) const override { return boundary->bounding_box_at(time); }
+
   private:
     shared_ptr<hittable> boundary;
     double neg_inv_density;
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "alias_table.h"
+#include "color.h"
+#include "rtw_image.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <cmath>
+#include <string>
+#include <vector>
+
+// Radiance arriving from infinitely far away, read from a latitude-longitude image (an HDR file through stb's float
+// loader). Row 0 is straight up (+y); columns go around the y axis the same way sphere texture coordinates do.
+//
+// Directions are importance sampled in proportion to each pixel's luminance times the solid angle it covers: an
+// alias table picks the row (the marginal distribution), a per-row table the column (the conditional one), and the
+// point within the pixel is uniform. Both picks take constant time.
+class environment_light {
+  public:
+    explicit environment_light(const std::string& filename, double scale = 1)
+        : image(filename, false), scale(scale) {
+        build();
+    }
+
+    [[nodiscard]] color value(const vec3& direction) const {
+        int column, row;
+        to_pixel(direction, column, row);
+        const auto* pixel = image.float_pixel_data(column, row);
+        return scale * color(pixel[0], pixel[1], pixel[2]);
+    }
+
+    // A direction towards the environment and its solid-angle density; false if the map is black.
+    bool sample(vec3& direction, double& density) const {
+        if(rows.empty())
+            return false;
+
+        auto row = rows.sample();
+        auto column = columns[row].sample();
+        auto u = (double(column) + random_double()) / width;
+        auto v = (double(row) + random_double()) / height;
+
+        direction = from_uv(u, v);
+        density = pixel_density(column, row, v);
+        return density > 0;
+    }
+
+    [[nodiscard]] double pdf_value(const vec3& direction) const {
+        if(rows.empty())
+            return 0;
+
+        int column, row;
+        auto v = to_pixel(direction, column, row);
+        return pixel_density(column, row, v);
+    }
+
+  private:
+    rtw_image image;
+    double scale;
+    int width = 0;
+    int height = 0;
+    alias_table rows;
+    std::vector<alias_table> columns;
+
+    void build() {
+        width = image.width();
+        height = image.height();
+        if(width <= 0 || height <= 0)
+            return;
+
+        std::vector<double> row_weights(height);
+        columns.reserve(height);
+        std::vector<double> weights(width);
+        for(int j = 0; j < height; j++) {
+            auto sin_theta = std::sin(pi * (j + 0.5) / height);
+            for(int i = 0; i < width; i++) {
+                const auto* pixel = image.float_pixel_data(i, j);
+                weights[i] = luminance(color(pixel[0], pixel[1], pixel[2])) * sin_theta;
+            }
+            columns.emplace_back(weights);
+            row_weights[j] = columns.back().weight_sum();
+        }
+        rows = alias_table(row_weights);
+    }
+
+    // Density over the unit square of (u, v), divided by the Jacobian 2 pi^2 sin(theta) of the mapping to
+    // directions.
+    [[nodiscard]] double pixel_density(int column, int row, double v) const {
+        auto sin_theta = std::sin(pi * v);
+        if(sin_theta <= 0)
+            return 0;
+        auto uv_density = rows.probability(size_t(row)) * columns[row].probability(size_t(column)) * width * height;
+        return uv_density / (2 * pi * pi * sin_theta);
+    }
+
+    // Returns v, the polar coordinate in [0, 1].
+    double to_pixel(const vec3& direction, int& column, int& row) const {
+        auto d = unit_vector(direction);
+        auto theta = std::acos(std::fmax(-1.0, std::fmin(1.0, double(d.y()))));
+        auto phi = std::atan2(-d.z(), d.x()) + pi;
+        auto u = phi / (2 * pi);
+        auto v = theta / pi;
+        column = std::min(int(u * width), width - 1);
+        row = std::min(int(v * height), height - 1);
+        return v;
+    }
+
+    static vec3 from_uv(double u, double v) {
+        auto phi = 2 * pi * u;
+        auto theta = pi * v;
+        auto sin_theta = std::sin(theta);
+        return vec3(-std::cos(phi) * sin_theta, std::cos(theta), std::sin(phi) * sin_theta);
+    }
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "interval.h"
+#include "material.h"
+#include "perlin.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "texture.h"
+#include "vec3.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Sparse voxel density over an axis-aligned region. Voxels are grouped into bricks of brick_size^3; only bricks
+// holding some non-zero density are allocated. Each brick also keeps the largest density inside it, which is the
+// majorant the medium tracks against, and an all-empty brick has a majorant of zero and is skipped entirely.
+class density_grid {
+  public:
+    static constexpr int brick_size = 8;
+
+    density_grid(const aabb& bounds, int nx, int ny, int nz) : box(bounds), res{nx, ny, nz} {
+        for(int a = 0; a < 3; a++) {
+            const auto& extent = box.axis_interval(a);
+            voxel[a] = extent.size() / res[a];
+            bricks[a] = (res[a] + brick_size - 1) / brick_size;
+        }
+        brick_slot.assign(size_t(bricks[0]) * bricks[1] * bricks[2], -1);
+        brick_max.assign(brick_slot.size(), 0.0);
+    }
+
+    // Samples density(p) at every voxel center.
+    template <typename Density>
+    density_grid(const aabb& bounds, int nx, int ny, int nz, Density&& density) : density_grid(bounds, nx, ny, nz) {
+        for(int k = 0; k < nz; k++)
+            for(int j = 0; j < ny; j++)
+                for(int i = 0; i < nx; i++)
+                    set(i, j, k, density(voxel_center(i, j, k)));
+    }
+
+    void set(int i, int j, int k, double value) {
+        auto cell = brick_cell(i / brick_size, j / brick_size, k / brick_size);
+        if(brick_slot[cell] < 0) {
+            if(value <= 0)
+                return;
+            brick_slot[cell] = std::int32_t(data.size() / brick_voxels);
+            data.resize(data.size() + brick_voxels, 0.0f);
+        }
+        data[size_t(brick_slot[cell]) * brick_voxels + voxel_in_brick(i, j, k)] = float(value);
+        brick_max[cell] = std::fmax(brick_max[cell], value);
+    }
+
+    // Density at p (nearest voxel), zero outside the grid.
+    [[nodiscard]] double value(const point3& p) const {
+        std::array<int, 3> v;
+        for(int a = 0; a < 3; a++) {
+            v[a] = int(std::floor((p[a] - box.axis_interval(a).min) / voxel[a]));
+            if(v[a] < 0 || v[a] >= res[a])
+                return 0;
+        }
+        auto slot = brick_slot[brick_cell(v[0] / brick_size, v[1] / brick_size, v[2] / brick_size)];
+        if(slot < 0)
+            return 0;
+        return data[size_t(slot) * brick_voxels + voxel_in_brick(v[0], v[1], v[2])];
+    }
+
+    [[nodiscard]] point3 voxel_center(int i, int j, int k) const {
+        return point3(box.x.min + (i + 0.5) * voxel[0], box.y.min + (j + 0.5) * voxel[1], box.z.min + (k + 0.5) * voxel[2]);
+    }
+
+    [[nodiscard]] const aabb& bounds() const { return box; }
+    [[nodiscard]] const std::array<int, 3>& brick_counts() const { return bricks; }
+    [[nodiscard]] vec3 brick_extent() const {
+        return vec3(voxel[0] * brick_size, voxel[1] * brick_size, voxel[2] * brick_size);
+    }
+    [[nodiscard]] double majorant(int bi, int bj, int bk) const { return brick_max[brick_cell(bi, bj, bk)]; }
+    [[nodiscard]] size_t allocated_bricks() const { return data.size() / brick_voxels; }
+
+  private:
+    static constexpr size_t brick_voxels = size_t(brick_size) * brick_size * brick_size;
+
+    aabb box;
+    std::array<int, 3> res;
+    std::array<double, 3> voxel;
+    std::array<int, 3> bricks;
+    std::vector<std::int32_t> brick_slot; // per brick cell: index of its voxels in data, or -1 if empty
+    std::vector<double> brick_max;
+    std::vector<float> data;
+
+    [[nodiscard]] size_t brick_cell(int bi, int bj, int bk) const {
+        return (size_t(bk) * bricks[1] + bj) * bricks[0] + bi;
+    }
+
+    static size_t voxel_in_brick(int i, int j, int k) {
+        return (size_t(k % brick_size) * brick_size + j % brick_size) * brick_size + i % brick_size;
+    }
+};
+
+// Cloud-like density from Perlin turbulence, faded out towards the edges of the box so the cloud has a soft
+// silhouette. Turbulence below `threshold` is cut to zero, which leaves whole bricks empty.
+inline shared_ptr<density_grid> perlin_cloud(const aabb& bounds, int resolution, double density, double scale,
+                                             double threshold = 0.25) {
+    perlin noise;
+    auto center = point3(bounds.x.min + bounds.x.size() / 2, bounds.y.min + bounds.y.size() / 2,
+                         bounds.z.min + bounds.z.size() / 2);
+    auto half = vec3(bounds.x.size() / 2, bounds.y.size() / 2, bounds.z.size() / 2);
+
+    return make_shared<density_grid>(bounds, resolution, resolution, resolution, [&](const point3& p) {
+        auto q = p - center;
+        auto r = std::sqrt((q.x() / half.x()) * (q.x() / half.x()) + (q.y() / half.y()) * (q.y() / half.y()) +
+                           (q.z() / half.z()) * (q.z() / half.z()));
+        auto shape = noise.turb(scale * p, 5) * (1 - r) * 2;
+        return shape > threshold ? density * (shape - threshold) : 0.0;
+    });
+}
+
+// Participating medium with spatially varying density. Free-flight distances are sampled with delta tracking and
+// visibility through the medium with ratio tracking, both against the per-brick majorants; a 3D DDA walks the brick
+// grid so empty bricks cost one step each.
+class grid_medium : public hittable {
+  public:
+    grid_medium(shared_ptr<const density_grid> grid, shared_ptr<texture> tex)
+        : grid(std::move(grid)), phase_function(make_shared<isotropic>(tex)) {}
+
+    grid_medium(shared_ptr<const density_grid> grid, const color& albedo)
+        : grid(std::move(grid)), phase_function(make_shared<isotropic>(albedo)) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        const auto speed = r.direction().length();
+        double t_hit = 0;
+
+        bool scattered = march(r, ray_t, [&](double t0, double t1, double majorant) {
+            auto t = t0;
+            while(true) {
+                t -= std::log(1 - random_double()) / (majorant * speed);
+                if(t >= t1)
+                    return false;
+                if(random_double() * majorant < grid->value(r.at(t))) {
+                    t_hit = t;
+                    return true;
+                }
+            }
+        });
+
+        if(!scattered)
+            return false;
+
+        rec.t = t_hit;
+        rec.p = r.at(t_hit);
+        rec.normal = vec3(1, 0, 0); // arbitrary
+        rec.front_face = true;      // also arbitrary
+        rec.mat = phase_function.get();
+        rec.object = nullptr;
+        return true;
+    }
+
+    // Stochastic visibility: blocked with probability 1 - transmittance.
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        return random_double() >= transmittance(r, ray_t);
+    }
+
+    // Unbiased estimate of the transmittance along r within ray_t (ratio tracking, with Russian roulette once the
+    // estimate gets small).
+    [[nodiscard]] double transmittance(const ray& r, interval ray_t) const override {
+        const auto speed = r.direction().length();
+        double estimate = 1;
+
+        march(r, ray_t, [&](double t0, double t1, double majorant) {
+            auto t = t0;
+            while(true) {
+                t -= std::log(1 - random_double()) / (majorant * speed);
+                if(t >= t1)
+                    return false;
+                estimate *= 1 - grid->value(r.at(t)) / majorant;
+                if(estimate < 0.1) {
+                    if(random_double() < 0.5) {
+                        estimate = 0;
+                        return true;
+                    }
+                    estimate *= 2;
+                }
+            }
+        });
+
+        return estimate;
+    }
+
+    [[nodiscard]] aabb bounding_box() const override { return grid->bounds(); }
+
+  private:
+    shared_ptr<const density_grid> grid;
+    shared_ptr<material> phase_function;
+
+    // Calls segment(t0, t1, majorant) for each stretch of the ray inside a non-empty brick, front to back, until it
+    // returns true. Returns whether it did.
+    template <typename Segment> bool march(const ray& r, interval ray_t, Segment&& segment) const {
+        const auto& box = grid->bounds();
+        const auto& orig = r.origin();
+        const auto& dir = r.direction();
+
+        for(int a = 0; a < 3; a++) {
+            const interval& ax = box.axis_interval(a);
+            const double adinv = 1.0 / dir[a];
+            auto t0 = (ax.min - orig[a]) * adinv;
+            auto t1 = (ax.max - orig[a]) * adinv;
+            if(t0 > t1)
+                std::swap(t0, t1);
+            ray_t.min = std::fmax(ray_t.min, t0);
+            ray_t.max = std::fmin(ray_t.max, t1);
+        }
+        if(ray_t.max <= ray_t.min)
+            return false;
+
+        const auto& counts = grid->brick_counts();
+        const auto extent = grid->brick_extent();
+        const auto entry = r.at(ray_t.min);
+
+        std::array<int, 3> cell, step;
+        std::array<double, 3> t_next, t_delta;
+        for(int a = 0; a < 3; a++) {
+            const auto lo = box.axis_interval(a).min;
+            cell[a] = std::clamp(int(std::floor((entry[a] - lo) / extent[a])), 0, counts[a] - 1);
+            step[a] = dir[a] > 0 ? 1 : -1;
+            if(dir[a] == 0) {
+                t_next[a] = t_delta[a] = infinity;
+                continue;
+            }
+            t_next[a] = (lo + (cell[a] + (dir[a] > 0 ? 1 : 0)) * extent[a] - orig[a]) / dir[a];
+            t_delta[a] = extent[a] / std::fabs(dir[a]);
+        }
+
+        auto t0 = ray_t.min;
+        while(t0 < ray_t.max) {
+            int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            auto t1 = std::fmin(t_next[axis], ray_t.max);
+
+            auto majorant = grid->majorant(cell[0], cell[1], cell[2]);
+            if(majorant > 0 && t1 > t0 && segment(t0, t1, majorant))
+                return true;
+
+            t0 = t1;
+            cell[axis] += step[axis];
+            if(cell[axis] < 0 || cell[axis] >= counts[axis])
+                break;
+            t_next[axis] += t_delta[axis];
+        }
+        return false;
+    }
+};
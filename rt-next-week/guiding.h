@@ -0,0 +1,298 @@
+#pragma once
+
+#include "aabb.h"
+#include "pdf.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Directional distribution over the sphere as an adaptive quadtree, after Mueller et al., "Practical Path Guiding
+// for Efficient Light-Transport Simulation". Directions map to the unit square by (cos theta, phi), which preserves
+// area, so a density over the square divided by 4 pi is a solid-angle density. Each node keeps the energy recorded
+// in its four quadrants; a quadrant without a child is a leaf of uniform density.
+class direction_tree {
+  public:
+    direction_tree() : nodes(1) {}
+
+    [[nodiscard]] double total() const {
+        const auto& s = nodes[0].sum;
+        return s[0] + s[1] + s[2] + s[3];
+    }
+
+    // Adds `value` to every quadrant on the way down to the leaf holding `direction`.
+    void record(const vec3& direction, double value) {
+        auto p = to_square(direction);
+        std::uint32_t n = 0;
+        while(true) {
+            auto q = quadrant(p);
+            nodes[n].sum[q] += value;
+            if(nodes[n].child[q] == 0)
+                return;
+            n = nodes[n].child[q];
+        }
+    }
+
+    [[nodiscard]] double pdf(const vec3& direction) const {
+        auto p = to_square(direction);
+        double density = 1;
+        std::uint32_t n = 0;
+        while(true) {
+            const auto& node = nodes[n];
+            auto node_total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+            if(node_total <= 0)
+                break;
+            auto q = quadrant(p);
+            density *= 4 * node.sum[q] / node_total;
+            if(node.child[q] == 0)
+                break;
+            n = node.child[q];
+        }
+        return density / (4 * pi);
+    }
+
+    [[nodiscard]] vec3 sample() const {
+        double x = 0, y = 0, size = 1;
+        std::uint32_t n = 0;
+        while(true) {
+            const auto& node = nodes[n];
+            auto node_total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+            int q = 3;
+            if(node_total <= 0) {
+                q = random_int(0, 3);
+            } else {
+                auto u = random_double() * node_total;
+                for(int c = 0; c < 3; c++) {
+                    if(u < node.sum[c]) {
+                        q = c;
+                        break;
+                    }
+                    u -= node.sum[c];
+                }
+            }
+
+            size /= 2;
+            x += (q & 1) ? size : 0;
+            y += (q & 2) ? size : 0;
+            if(node_total <= 0 || node.child[q] == 0)
+                break;
+            n = node.child[q];
+        }
+        return from_square(x + size * random_double(), y + size * random_double());
+    }
+
+    // A tree for recording the next pass: quadrants holding more than `threshold` of the energy recorded here are
+    // subdivided (energy is assumed uniform below existing leaves), the others collapsed; all sums start at zero.
+    [[nodiscard]] direction_tree refined(double threshold, int max_depth) const {
+        direction_tree tree;
+        auto t = total();
+        if(t > 0)
+            tree.refine_from(*this, 0, nodes[0].sum, 0, threshold * t, max_depth);
+        for(auto& node : tree.nodes)
+            node.sum = {0, 0, 0, 0};
+        return tree;
+    }
+
+  private:
+    struct node {
+        std::array<double, 4> sum{0, 0, 0, 0};
+        std::array<std::uint32_t, 4> child{0, 0, 0, 0}; // 0: leaf (the root is never a child)
+    };
+
+    std::vector<node> nodes;
+
+    // Quadrant of p, which is then rescaled to that quadrant.
+    static int quadrant(point3& p) {
+        int q = 0;
+        for(int axis = 0; axis < 2; axis++) {
+            p[axis] *= 2;
+            if(p[axis] >= 1) {
+                p[axis] -= 1;
+                q |= 1 << axis;
+            }
+        }
+        return q;
+    }
+
+    // On the path of every density the guide is asked for, so kept cheap: the direction is not normalized, which
+    // atan2 does not need, and the angle around z comes out in [0, 2 pi] without a branch.
+    static point3 to_square(const vec3& direction) {
+        auto z = direction.z() / direction.length();
+        auto phi = std::atan2(-direction.y(), -direction.x()) + pi;
+        auto u = std::fmin(0.5 * (std::fmax(-1.0, std::fmin(1.0, double(z))) + 1), 1 - 1e-9);
+        auto v = std::fmin(phi * (1 / (2 * pi)), 1 - 1e-9);
+        return point3(u, v, 0);
+    }
+
+    static vec3 from_square(double u, double v) {
+        auto z = 2 * u - 1;
+        auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+        auto phi = 2 * pi * v;
+        return vec3(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    // Copies the node (from `source`'s node `from`, or a virtual one with energy `sums` if from is 0 below the root)
+    // into this tree as node `into`.
+    void refine_from(const direction_tree& source, std::uint32_t from, const std::array<double, 4>& sums,
+                     std::uint32_t into, double split_above, int depth_left) {
+        nodes[into].sum = sums;
+        for(int q = 0; q < 4; q++) {
+            if(sums[q] <= split_above || depth_left <= 1)
+                continue;
+
+            std::uint32_t source_child = from == none ? none : source.nodes[from].child[q];
+            std::array<double, 4> child_sums;
+            if(source_child == 0 || source_child == none) {
+                child_sums.fill(sums[q] / 4);
+                source_child = none;
+            } else {
+                child_sums = source.nodes[source_child].sum;
+            }
+
+            auto index = std::uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[into].child[q] = index;
+            refine_from(source, source_child, child_sums, index, split_above, depth_left - 1);
+        }
+    }
+
+    static constexpr std::uint32_t none = ~std::uint32_t(0);
+};
+
+// A learned distribution as a pdf, to mix with the material's. At a surface, directions below it are folded up
+// across the tangent plane: a leaf of the field spans surfaces facing different ways, and a guided direction into
+// the surface would be wasted.
+class guide_pdf : public pdf {
+  public:
+    explicit guide_pdf(const direction_tree& tree) : tree(tree) {}
+    guide_pdf(const direction_tree& tree, const vec3& normal) : tree(tree), normal(normal), folded(true) {}
+
+    [[nodiscard]] double value(const vec3& direction) const override {
+        if(!folded)
+            return tree.pdf(direction);
+        auto along = dot(direction, normal);
+        return along <= 0 ? 0 : tree.pdf(direction) + tree.pdf(direction - 2 * along * normal);
+    }
+
+    [[nodiscard]] vec3 generate() const override {
+        auto direction = tree.sample();
+        auto along = dot(direction, normal);
+        return folded && along < 0 ? direction - 2 * along * normal : direction;
+    }
+
+  private:
+    const direction_tree& tree;
+    vec3 normal;
+    bool folded = false;
+};
+
+// Spatial binary tree over the scene, each leaf holding the directional distribution learned there in the last
+// pass and the one being recorded in the current pass. Leaves split in the middle, cycling through the axes of a
+// cube around the scene, once a pass records more samples in them than the threshold for the next pass.
+class guiding_field {
+  public:
+    guiding_field() = default;
+
+    explicit guiding_field(const aabb& scene) : nodes(1), leaves(1) {
+        // A cube, so that halving cycles through the axes evenly.
+        auto size = std::fmax(scene.x.size(), std::fmax(scene.y.size(), scene.z.size()));
+        origin = point3(scene.x.min, scene.y.min, scene.z.min);
+        extent = size > 0 && std::isfinite(size) ? size : 1;
+        nodes[0].leaf = 0;
+    }
+
+    [[nodiscard]] bool empty() const { return nodes.empty(); }
+
+    // The distribution learned for p, or null where nothing was recorded.
+    [[nodiscard]] const direction_tree* sampling_at(const point3& p) const {
+        const auto& tree = leaves[locate(p)].sampling;
+        return tree.total() > 0 ? &tree : nullptr;
+    }
+
+    void record(const point3& p, const vec3& direction, double value) {
+        auto& leaf = leaves[locate(p)];
+        leaf.building.record(direction, value);
+        leaf.samples++;
+    }
+
+    // Ends a pass: splits crowded leaves, turns what was recorded into the sampling distributions and prepares
+    // refined trees to record the next pass into. The sample threshold grows with the square root of the pass's
+    // samples per pixel, `spp`, as passes double them.
+    void finish_pass(int spp) {
+        auto threshold = spatial_threshold * std::sqrt(double(spp));
+        split(0, 0, threshold);
+        for(auto& leaf : leaves) {
+            leaf.sampling = leaf.building;
+            leaf.building = leaf.building.refined(direction_threshold, max_direction_depth);
+            leaf.samples = 0;
+        }
+    }
+
+  private:
+    static constexpr double spatial_threshold = 4000;
+    static constexpr double direction_threshold = 0.01;
+    static constexpr int max_direction_depth = 20;
+    static constexpr std::uint32_t none = ~std::uint32_t(0);
+
+    struct node {
+        std::array<std::uint32_t, 2> child{none, none};
+        std::uint32_t leaf = none;
+    };
+
+    struct leaf_data {
+        direction_tree sampling;
+        direction_tree building;
+        double samples = 0;
+    };
+
+    point3 origin;
+    double extent = 1;
+    std::vector<node> nodes;
+    std::vector<leaf_data> leaves;
+
+    [[nodiscard]] std::uint32_t locate(const point3& p) const {
+        auto x = (p - origin) / extent;
+        std::uint32_t n = 0;
+        for(int axis = 0; nodes[n].leaf == none; axis = (axis + 1) % 3) {
+            auto c = x[axis] * 2;
+            int side = c >= 1 ? 1 : 0;
+            x[axis] = c - side;
+            n = nodes[n].child[side];
+        }
+        return nodes[n].leaf;
+    }
+
+    void split(std::uint32_t n, int axis, double threshold) {
+        if(nodes[n].leaf == none) {
+            for(int side = 0; side < 2; side++)
+                split(nodes[n].child[side], (axis + 1) % 3, threshold);
+            return;
+        }
+
+        auto l = nodes[n].leaf;
+        if(leaves[l].samples <= threshold || nodes.size() > max_nodes)
+            return;
+
+        // Both halves start with the parent's distribution and half its samples.
+        leaves[l].samples /= 2;
+        auto copy = leaves[l];
+        nodes[n].leaf = none;
+        for(int side = 0; side < 2; side++) {
+            auto child = std::uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[n].child[side] = child;
+            if(side == 0) {
+                nodes[child].leaf = l;
+            } else {
+                nodes[child].leaf = std::uint32_t(leaves.size());
+                leaves.push_back(copy);
+            }
+        }
+        for(int side = 0; side < 2; side++)
+            split(nodes[n].child[side], (axis + 1) % 3, threshold);
+    }
+
+    static constexpr size_t max_nodes = 1 << 16;
+};
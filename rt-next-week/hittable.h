@@ -1,119 +1,222 @@
 #pragma once
 
 #include "aabb.h"
+#include "affine.h"
 #include "interval.h"
+#include "light_bounds.h"
 #include "ray.h"
 #include "rtweekend.h"
 #include "vec3.h"
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <utility>
+#include <vector>
 
+class hittable;
 class material;
 
+// Filled in two phases. hit() only records t, the primitive that reported it and whatever that primitive needs to
+// rebuild the surface (an index in `primitive`, parameters or barycentrics in u and v). finalize() then computes the
+// point, normal, texture coordinates and material once, for the closest hit only.
 class hit_record {
   public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
-    double t;
-    double u;
-    double v;
+    const material* mat = nullptr; // owned by the primitive that was hit
+    real t;
+    real u;
+    real v;
+    real p_error = 0; // bound on the rounding error in each coordinate of p
     bool front_face;
+    real texture_scale = 0; // (u, v) units per unit of length across the surface at p; 0 where unknown
+    real footprint = 0;     // width of the ray's footprint at p in (u, v) units, for filtering; 0 samples a point
+
+    const hittable* object = nullptr; // pending finalize, null once the surface data is complete
+    std::uint32_t primitive = 0;
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    // r must be the ray the hit was found with.
+    inline void finalize(const ray& r);
+
+    // Where a ray leaving the surface in `direction` should start: p pushed along the normal, to the side the ray
+    // leaves on, by its rounding error, so the ray cannot find the surface it starts on again.
+    [[nodiscard]] point3 spawn_origin(const vec3& direction) const {
+        auto offset = p_error * (std::fabs(normal.x()) + std::fabs(normal.y()) + std::fabs(normal.z()));
+        return p + (dot(direction, normal) > 0 ? offset : -offset) * normal;
+    }
 };
 
 class hittable {
   public:
     virtual ~hittable() = default;
+    // Closest-hit query. Implementations only write rec when they report a hit, so callers can pass the same record
+    // to several objects while shrinking ray_t.
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+    // Adds the spans of ray_t over which r is inside this object, assuming it is a closed solid. The default pairs up
+    // successive hits as entry and exit; convex primitives override it to get both from one intersection test.
+    virtual void inside(const ray& r, interval ray_t, interval_list& spans) const {
+        hit_record rec;
+        auto t = -infinity;
+        while(spans.size() < interval_list::capacity && hit(r, interval(t, infinity), rec)) {
+            auto entry = rec.t;
+            if(!hit(r, interval(entry + 0.0001, infinity), rec))
+                break;
+            spans.add(interval(std::fmax(entry, ray_t.min), std::fmin(rec.t, ray_t.max)));
+            if(rec.t >= ray_t.max)
+                break;
+            t = rec.t + 0.0001;
+        }
+    }
+
+    // Completes a hit this object recorded in rec.object. Objects that fill in everything during hit() leave
+    // rec.object null and never get this call.
+    virtual void finalize(const ray& r, hit_record& rec) const {}
+
+    // Any-hit query for shadow and visibility rays: true as soon as anything blocks the ray within ray_t. Nothing
+    // beyond the intersection distance itself needs to be computed.
+    [[nodiscard]] virtual bool occluded(const ray& r, interval ray_t) const {
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
+
+    // Fraction of the light along r within ray_t that gets through, for shadow rays: 0 past anything opaque, and in
+    // between through participating media. Media may return a random estimate, as long as it is unbiased.
+    [[nodiscard]] virtual double transmittance(const ray& r, interval ray_t) const {
+        return occluded(r, ray_t) ? 0 : 1;
+    }
+
     [[nodiscard]] virtual aabb bounding_box() const = 0;
+
+    // Bounds at shutter time `time` in [0, 1]. Motion-aware structures interpolate linearly between the boxes at the
+    // two ends of the shutter, so a moving object should report boxes that stay conservative under that
+    // interpolation. The default, the box over the whole shutter, always is.
+    [[nodiscard]] virtual aabb bounding_box_at(double time) const { return bounding_box(); }
+
+    // Appends the emitters that direct light sampling can aim at. Containers recurse; emitters that cannot be
+    // sampled (under a transform or in a mesh) are left out and only found by scattered rays.
+    virtual void collect_lights(std::vector<const hittable*>& lights) const {}
+
+    // For objects reported by collect_lights: random() returns a direction, not normalized, from `origin` towards a
+    // point on the object, and pdf_value the solid-angle density of random() producing `direction`.
+    [[nodiscard]] virtual double pdf_value(const point3& origin, const vec3& direction) const { return 0; }
+    [[nodiscard]] virtual vec3 random(const point3& origin) const { return {1, 0, 0}; }
+
+    // Also for those objects: a uniform point on the surface, finalized as a hit there (normal pointing out), and
+    // the total area, for emitting photons. False if the object does not support it.
+    virtual bool sample_surface(hit_record& rec, double& total_area) const { return false; }
+
+    // Where the object emits, how strongly and in which directions, for building the light hierarchy. Empty (no
+    // power) for objects that do not emit.
+    [[nodiscard]] virtual light_bounds emission_bounds() const { return {}; }
 };
 
-class translate : public hittable {
+inline void hit_record::finalize(const ray& r) {
+    if(const hittable* pending = object) {
+        object = nullptr;
+        p_error = 0;
+        texture_scale = 0;
+        pending->finalize(r, *this);
+        // Primitives that know better (a sphere's error depends on its radius) set a larger bound themselves.
+        p_error = std::max(p_error, rounding_error(max_abs(p) + max_abs(r.origin())));
+    }
+}
+
+// Instance of an object under an affine transform. The ray is carried into object space once with the stored
+// inverse, and the finalized hit is carried back. Wrapping another transform multiplies the two matrices at
+// construction, so nested instancing costs a single transform per ray however deep it was built.
+class transform : public hittable {
   public:
-    translate(shared_ptr<hittable> object, const vec3& offset) : object(std::move(object)), offset(offset) {}
+    transform(shared_ptr<hittable> object, const affine& object_to_world)
+        : object(std::move(object)), to_world(object_to_world) {
+        if(auto inner = std::dynamic_pointer_cast<transform>(this->object)) {
+            this->object = inner->object;
+            to_world = to_world * inner->to_world;
+        }
+        to_object = to_world.inverse();
+        volume_scale = std::fabs(to_world.determinant());
+        bbox = to_world_box(this->object->bounding_box());
+    }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        ray offset_r(r.origin() - offset, r.direction(), r.time());
-
-        if(!object->hit(offset_r, ray_t, rec))
+        auto object_r = object_ray(r);
+        if(!object->hit(object_r, ray_t, rec))
             return false;
 
-        rec.p += offset;
-
+        // The surface has to be completed in object space before it can be moved back.
+        rec.finalize(object_r);
+        rec.p = to_world.point(rec.p);
+        rec.p_error = rec.p_error * to_world.norm() + rounding_error(max_abs(rec.p));
+        // Areas on the surface grow by the determinant times the length of the carried (unnormalized) normal.
+        auto normal = to_object.transposed_vector(rec.normal);
+        rec.texture_scale /= std::sqrt(volume_scale * normal.length());
+        rec.normal = unit_vector(normal);
         return true;
     }
 
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(object_ray(r), ray_t);
+    }
+
+    [[nodiscard]] double transmittance(const ray& r, interval ray_t) const override {
+        return object->transmittance(object_ray(r), ray_t);
+    }
+
+    void inside(const ray& r, interval ray_t, interval_list& spans) const override {
+        object->inside(object_ray(r), ray_t, spans);
+    }
+
     [[nodiscard]] aabb bounding_box() const override { return bbox; }
 
+    [[nodiscard]] aabb bounding_box_at(double time) const override {
+        return to_world_box(object->bounding_box_at(time));
+    }
+
+    [[nodiscard]] const affine& object_to_world() const { return to_world; }
+
   private:
     shared_ptr<hittable> object;
-    vec3 offset;
+    affine to_world;
+    affine to_object;
+    double volume_scale = 1;
     aabb bbox;
-};
-
-class rotate_y : public hittable {
-  public:
-    rotate_y(shared_ptr<hittable> object, double angle) : object(object) {
-        auto radians = degrees_to_radians(angle);
-        sin_theta = std::sin(radians);
-        cos_theta = std::cos(radians);
-        bbox = object->bounding_box();
 
+    [[nodiscard]] aabb to_world_box(const aabb& box) const {
         point3 min(infinity, infinity, infinity);
         point3 max(-infinity, -infinity, -infinity);
-
         for(int i = 0; i < 2; i++)
             for(int j = 0; j < 2; j++)
                 for(int k = 0; k < 2; k++) {
-                    auto x = i * bbox.x.max + (1 - i) * bbox.x.min;
-                    auto y = j * bbox.y.max + (1 - j) * bbox.y.min;
-                    auto z = k * bbox.z.max + (1 - k) * bbox.z.min;
-
-                    auto newx = cos_theta * x + sin_theta * z;
-                    auto newz = -sin_theta * x + cos_theta * z;
-
-                    vec3 tester(newx, y, newz);
-
+                    auto corner = to_world.point(
+                        point3(i ? box.x.max : box.x.min, j ? box.y.max : box.y.min, k ? box.z.max : box.z.min));
                     for(int c = 0; c < 3; c++) {
-                        min[c] = std::fmin(min[c], tester[c]);
-                        max[c] = std::fmax(max[c], tester[c]);
+                        min[c] = std::fmin(min[c], corner[c]);
+                        max[c] = std::fmax(max[c], corner[c]);
                     }
                 }
-
-        bbox = aabb(min, max);
+        return {min, max};
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        auto origin = point3((cos_theta * r.origin().x()) - (sin_theta * r.origin().z()), r.origin().y(),
-                             (sin_theta * r.origin().x()) + (cos_theta * r.origin().z()));
-
-        auto direction = vec3((cos_theta * r.direction().x()) - (sin_theta * r.direction().z()), r.direction().y(),
-                              (sin_theta * r.direction().x()) + (cos_theta * r.direction().z()));
-
-        ray rotated_r(origin, direction, r.time());
-
-        if(!object->hit(rotated_r, ray_t, rec))
-            return false;
-
-        rec.p = point3((cos_theta * rec.p.x()) + (sin_theta * rec.p.z()), rec.p.y(),
-                       (-sin_theta * rec.p.x()) + (cos_theta * rec.p.z()));
-
-        rec.normal = vec3((cos_theta * rec.normal.x()) + (sin_theta * rec.normal.z()), rec.normal.y(),
-                          (-sin_theta * rec.normal.x()) + (cos_theta * rec.normal.z()));
-
-        return true;
+    // Direction is transformed without normalizing, so t means the same distance along both rays.
+    [[nodiscard]] ray object_ray(const ray& r) const {
+        return {to_object.point(r.origin()), to_object.vector(r.direction()), r.time()};
     }
+};
 
-    [[nodiscard]] aabb bounding_box() const override { return bbox; }
+class translate : public transform {
+  public:
+    translate(shared_ptr<hittable> object, const vec3& offset)
+        : transform(std::move(object), affine::translation(offset)) {}
+};
 
-  private:
-    shared_ptr<hittable> object;
-    double sin_theta;
-    double cos_theta;
-    aabb bbox;
+class rotate_y : public transform {
+  public:
+    rotate_y(shared_ptr<hittable> object, double angle)
+        : transform(std::move(object), affine::rotation(vec3(0, 1, 0), angle)) {}
 };
@@ -24,23 +24,50 @@ class hittable_list : public hittable {
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record temp_rec;
         bool hit_anything = false;
         auto closest_so_far = ray_t.max;
 
         for(const auto& object : objects) {
-            if(object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+            if(object->hit(r, interval(ray_t.min, closest_so_far), rec)) {
                 hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                closest_so_far = rec.t;
             }
         }
 
         return hit_anything;
     }
 
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        for(const auto& object : objects)
+            if(object->occluded(r, ray_t))
+                return true;
+        return false;
+    }
+
+    [[nodiscard]] double transmittance(const ray& r, interval ray_t) const override {
+        double fraction = 1;
+        for(const auto& object : objects) {
+            fraction *= object->transmittance(r, ray_t);
+            if(fraction <= 0)
+                break;
+        }
+        return fraction;
+    }
+
     [[nodiscard]] aabb bounding_box() const override { return bbox; }
 
+    void collect_lights(std::vector<const hittable*>& lights) const override {
+        for(const auto& object : objects)
+            object->collect_lights(lights);
+    }
+
+    [[nodiscard]] aabb bounding_box_at(double time) const override {
+        aabb box = aabb::empty;
+        for(const auto& object : objects)
+            box = aabb(box, object->bounding_box_at(time));
+        return box;
+    }
+
   private:
     aabb bbox;
 };
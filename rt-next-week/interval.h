@@ -1,23 +1,25 @@
 #pragma once
 
 #include "rtweekend.h"
+#include <array>
+
 class interval {
   public:
-    double min, max;
+    real min, max;
     interval() : min(+infinity), max(-infinity) {}
-    interval(double min, double max) : min(min), max(max) {}
+    interval(real min, real max) : min(min), max(max) {}
     interval(const interval& a, const interval& b) {
         min = a.min <= b.min ? a.min : b.min;
         max = a.max >= b.max ? a.max : b.max;
     }
 
-    [[nodiscard]] double size() const { return max - min; }
+    [[nodiscard]] real size() const { return max - min; }
 
-    [[nodiscard]] bool contains(double x) const { return min <= x && x <= max; }
+    [[nodiscard]] bool contains(real x) const { return min <= x && x <= max; }
 
-    [[nodiscard]] bool surrounds(double x) const { return min < x && x < max; }
+    [[nodiscard]] bool surrounds(real x) const { return min < x && x < max; }
 
-    [[nodiscard]] double clamp(double x) const {
+    [[nodiscard]] real clamp(real x) const {
         if(x < min)
             return min;
         if(x > max)
@@ -26,7 +28,7 @@ class interval {
         return x;
     }
 
-    [[nodiscard]] interval expand(double delta) const {
+    [[nodiscard]] interval expand(real delta) const {
         auto padding = delta / 2;
         return {min - padding, max + padding};
     }
@@ -34,10 +36,31 @@ class interval {
     static const interval empty, universe;
 };
 
-const interval interval::empty = {+infinity, -infinity};
-const interval interval::universe = {-infinity, +infinity};
+const interval interval::empty = interval(+infinity, -infinity);
+const interval interval::universe = interval(-infinity, +infinity);
 
-inline interval operator+(const interval& ival, double displacement) {
+inline interval operator+(const interval& ival, real displacement) {
     return {ival.min + displacement, ival.max + displacement};
 }
-inline interval operator+(double displacement, const interval& ival) { return ival + displacement; }
+inline interval operator+(real displacement, const interval& ival) { return ival + displacement; }
+
+// The stretches of a ray that lie inside a solid, in increasing order. Fixed capacity, so queries never allocate;
+// spans past the capacity are dropped.
+class interval_list {
+  public:
+    static constexpr int capacity = 8;
+
+    void add(const interval& span) {
+        if(span.min < span.max && count < capacity)
+            spans[count++] = span;
+    }
+
+    [[nodiscard]] int size() const { return count; }
+    [[nodiscard]] bool empty() const { return count == 0; }
+    [[nodiscard]] const interval* begin() const { return spans.data(); }
+    [[nodiscard]] const interval* end() const { return spans.data() + count; }
+
+  private:
+    std::array<interval, capacity> spans;
+    int count = 0;
+};
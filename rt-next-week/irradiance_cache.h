@@ -0,0 +1,188 @@
+#pragma once
+
+#include "color.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// Irradiance at a point of a diffuse surface, with its gradients under rotation and translation (one vector per
+// color channel) and the harmonic mean distance of the surfaces it was gathered from.
+struct irradiance_record {
+    point3 p;
+    vec3 normal;
+    color irradiance;
+    std::array<vec3, 3> rotational;
+    std::array<vec3, 3> translational;
+    double radius;
+};
+
+// Ward's irradiance cache: records computed where no existing one is close enough, and interpolated between
+// otherwise, with Ward and Heckbert's gradients. A record is used at points within `error` times its radius (less as
+// the normals differ), so `error` bounds the interpolation error. Records are found through a hash grid of cells as
+// large as the widest such neighbourhood, each listing the records that reach into it.
+//
+// Lookups share a lock and insertions take it exclusively, so render threads can fill the cache as they go.
+class irradiance_cache {
+  public:
+    // Clears the cache. Record radii are clamped to [min_radius, max_radius].
+    void reset(double error_bound, double min_radius, double max_radius) {
+        std::unique_lock lock(mutex);
+        error = error_bound;
+        radius_min = min_radius;
+        radius_max = max_radius;
+        cell_size = error * max_radius;
+        records.clear();
+        cells.clear();
+    }
+
+    // Irradiance at p on a surface facing `normal`, interpolated from the records valid there. False if there are
+    // none.
+    bool lookup(const point3& p, const vec3& normal, color& irradiance) const {
+        std::shared_lock lock(mutex);
+        auto it = cells.find(key(cell(p.x()), cell(p.y()), cell(p.z())));
+        if(it == cells.end())
+            return false;
+
+        color sum(0, 0, 0);
+        double weight_sum = 0;
+        for(auto index : it->second) {
+            const auto& r = records[index];
+            auto offset = p - r.p;
+            auto e = offset.length() / r.radius + std::sqrt(std::fmax(0.0, 1 - double(dot(normal, r.normal))));
+            // Skip records too far or turned too far away, and those in front of p, which see a different scene.
+            if(e >= error || dot(offset, normal + r.normal) < -0.1 * r.radius)
+                continue;
+
+            auto turn = cross(r.normal, normal);
+            color value = r.irradiance;
+            for(int c = 0; c < 3; c++)
+                value[c] += dot(turn, r.rotational[c]) + dot(offset, r.translational[c]);
+
+            // Ward's weight, shifted to fall to zero at the edge of the neighbourhood.
+            auto weight = 1 / std::fmax(e, 1e-6) - 1 / error;
+            sum += weight * value;
+            weight_sum += weight;
+        }
+        if(weight_sum <= 0)
+            return false;
+
+        irradiance = sum / weight_sum;
+        for(int c = 0; c < 3; c++)
+            irradiance[c] = std::fmax(0.0, double(irradiance[c]));
+        return true;
+    }
+
+    void insert(const irradiance_record& record) {
+        std::unique_lock lock(mutex);
+        auto index = std::uint32_t(records.size());
+        records.push_back(record);
+
+        auto reach = error * record.radius;
+        for(auto x = cell(record.p.x() - reach); x <= cell(record.p.x() + reach); x++)
+            for(auto y = cell(record.p.y() - reach); y <= cell(record.p.y() + reach); y++)
+                for(auto z = cell(record.p.z() - reach); z <= cell(record.p.z() + reach); z++)
+                    cells[key(x, y, z)].push_back(index);
+    }
+
+    // Cosine-weighted direction of stratum (j, k) of `rings` by `sectors`, offset (u, v) within it, in the frame
+    // whose third axis is the normal. gather() expects radiance along these.
+    static vec3 stratum_direction(int j, int k, int rings, int sectors, double u, double v,
+                                  const std::array<vec3, 3>& frame) {
+        auto sin_theta = std::sqrt((j + u) / rings);
+        auto cos_theta = std::sqrt(std::fmax(0.0, 1 - sin_theta * sin_theta));
+        auto phi = 2 * pi * (k + v) / sectors;
+        return (sin_theta * std::cos(phi)) * frame[0] + (sin_theta * std::sin(phi)) * frame[1] + cos_theta * frame[2];
+    }
+
+    // A record from the radiance and hit distance of every stratum, stored at [j * sectors + k], together with the
+    // radial offsets the directions were drawn with (for the exact sine of each sample).
+    [[nodiscard]] irradiance_record gather(const point3& p, const std::array<vec3, 3>& frame, int rings, int sectors,
+                                           const std::vector<color>& radiance, const std::vector<double>& distance,
+                                           const std::vector<double>& ring_offset) const {
+        irradiance_record r;
+        r.p = p;
+        r.normal = frame[2];
+        r.irradiance = color(0, 0, 0);
+        r.rotational.fill(vec3(0, 0, 0));
+        r.translational.fill(vec3(0, 0, 0));
+
+        auto at = [sectors](int j, int k) { return j * sectors + (k + sectors) % sectors; };
+        auto in_plane = [&frame](double phi) { return std::cos(phi) * frame[0] + std::sin(phi) * frame[1]; };
+        auto sin_edge = [rings](int j) { return std::sqrt(double(j) / rings); };
+
+        double inverse_distance_sum = 0;
+        for(int k = 0; k < sectors; k++) {
+            auto phi_edge = 2 * pi * k / sectors;
+            auto u_k = in_plane(2 * pi * (k + 0.5) / sectors);
+            auto v_k = in_plane(2 * pi * (k + 0.5) / sectors + pi / 2);
+            auto v_edge = in_plane(phi_edge + pi / 2);
+
+            for(int j = 0; j < rings; j++) {
+                const auto& L = radiance[at(j, k)];
+                r.irradiance += L;
+                inverse_distance_sum += 1 / distance[at(j, k)];
+
+                auto sin_theta = std::sqrt((j + ring_offset[at(j, k)]) / rings);
+                auto cos_theta = std::sqrt(std::fmax(1e-6, 1 - sin_theta * sin_theta));
+                for(int c = 0; c < 3; c++)
+                    r.rotational[c] += (sin_theta / cos_theta * L[c]) * v_k;
+
+                // Change across the edge between sectors k - 1 and k.
+                auto cos_lower = std::sqrt(1 - sin_edge(j) * sin_edge(j));
+                auto cos_upper = std::sqrt(std::fmax(0.0, 1 - sin_edge(j + 1) * sin_edge(j + 1)));
+                auto across = (cos_lower - cos_upper) /
+                              (std::fmax(sin_theta, 1e-6) * std::fmin(distance[at(j, k)], distance[at(j, k - 1)]));
+                const auto& previous_sector = radiance[at(j, k - 1)];
+                for(int c = 0; c < 3; c++)
+                    r.translational[c] += (across * (L[c] - previous_sector[c])) * v_edge;
+
+                // Change across the edge between rings j - 1 and j.
+                if(j > 0) {
+                    auto s = sin_edge(j);
+                    auto along = (2 * pi / sectors) * s * (1 - s * s) /
+                                 std::fmin(distance[at(j, k)], distance[at(j - 1, k)]);
+                    const auto& previous_ring = radiance[at(j - 1, k)];
+                    for(int c = 0; c < 3; c++)
+                        r.translational[c] += (along * (L[c] - previous_ring[c])) * u_k;
+                }
+            }
+        }
+
+        auto scale = pi / (rings * sectors);
+        r.irradiance = scale * r.irradiance;
+        for(int c = 0; c < 3; c++)
+            r.rotational[c] = scale * r.rotational[c];
+
+        // Harmonic mean distance, no larger than the distance over which the gradient would double the irradiance.
+        auto radius = rings * sectors / inverse_distance_sum;
+        auto gradient = 0.2126 * r.translational[0] + 0.7152 * r.translational[1] + 0.0722 * r.translational[2];
+        if(gradient.length() > 0)
+            radius = std::fmin(radius, luminance(r.irradiance) / gradient.length());
+        r.radius = std::fmax(radius_min, std::fmin(radius_max, radius));
+        return r;
+    }
+
+  private:
+    mutable std::shared_mutex mutex;
+    double error = 0.2;
+    double radius_min = 0;
+    double radius_max = 1;
+    double cell_size = 0.2;
+    std::vector<irradiance_record> records;
+    std::unordered_map<std::uint64_t, std::vector<std::uint32_t>> cells;
+
+    [[nodiscard]] std::int64_t cell(double coordinate) const {
+        return std::int64_t(std::floor(coordinate / cell_size));
+    }
+
+    static std::uint64_t key(std::int64_t x, std::int64_t y, std::int64_t z) {
+        constexpr std::uint64_t mask = (1 << 21) - 1;
+        return (std::uint64_t(x) & mask) | (std::uint64_t(y) & mask) << 21 | (std::uint64_t(z) & mask) << 42;
+    }
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "aabb.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <algorithm>
+#include <cmath>
+
+// Conservative summary of one emitter or a cluster of them, after Estevez and Kulla's light hierarchy: where they
+// are, how much power they emit, and which way. Normals lie within theta_o of `axis`, and each emitter still emits
+// up to theta_e past its normal (pi/2 for a diffuse surface). Angles are kept as cosines.
+struct light_bounds {
+    aabb bounds = aabb::empty;
+    vec3 axis = vec3(0, 0, 1);
+    double power = 0;
+    double cos_theta_o = 1;
+    double cos_theta_e = 0;
+    bool two_sided = false;
+
+    [[nodiscard]] bool empty() const { return power <= 0; }
+
+    [[nodiscard]] point3 center() const {
+        return point3(0.5 * (bounds.x.min + bounds.x.max), 0.5 * (bounds.y.min + bounds.y.max),
+                      0.5 * (bounds.z.min + bounds.z.max));
+    }
+
+    // Upper estimate of what the emitters could contribute at p: power over squared distance, times the cosine of
+    // the smallest angle between the direction to p and any normal, widened by the angle the bounds subtend.
+    // Zero when p lies outside every emitter's range.
+    [[nodiscard]] double importance(const point3& p) const {
+        if(empty())
+            return 0;
+
+        auto to_p = p - center();
+        auto length_squared = double(to_p.length_squared());
+        auto half_diagonal_squared = 0.25 * vec3(bounds.x.size(), bounds.y.size(), bounds.z.size()).length_squared();
+
+        // Angle subtended by the bounding sphere of the box; everything if p is inside it.
+        double cos_theta_b = -1;
+        if(length_squared > half_diagonal_squared)
+            cos_theta_b = std::sqrt(1 - half_diagonal_squared / length_squared);
+        auto sin_theta_b = sin_of(cos_theta_b);
+
+        double cos_theta_w = length_squared > 0 ? dot(axis, to_p) / std::sqrt(length_squared) : 1;
+        if(two_sided)
+            cos_theta_w = std::fabs(cos_theta_w);
+        auto sin_theta_w = sin_of(cos_theta_w);
+        auto sin_theta_o = sin_of(cos_theta_o);
+
+        // theta' = max(0, theta_w - theta_o - theta_b), with the subtractions done on sines and cosines.
+        auto cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+        auto sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+        auto cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+        if(cos_theta_p <= cos_theta_e)
+            return 0;
+
+        return power * cos_theta_p / std::fmax(length_squared, half_diagonal_squared);
+    }
+
+    // Orientation-weighted surface area cost of a cluster for building the hierarchy.
+    [[nodiscard]] double cost(double axis_scale) const {
+        if(empty())
+            return 0;
+        auto theta_o = std::acos(std::clamp(cos_theta_o, -1.0, 1.0));
+        auto theta_e = std::acos(std::clamp(cos_theta_e, -1.0, 1.0));
+        auto theta_w = std::fmin(theta_o + theta_e, pi);
+        auto sin_theta_o = sin_of(cos_theta_o);
+        auto m_omega = 2 * pi * (1 - cos_theta_o) + pi / 2 *
+                       (2 * theta_w * sin_theta_o - std::cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_theta_o +
+                        cos_theta_o);
+
+        auto sx = bounds.x.size(), sy = bounds.y.size(), sz = bounds.z.size();
+        auto area = 2 * (sx * sy + sy * sz + sz * sx);
+        return power * m_omega * axis_scale * area;
+    }
+
+  private:
+    static double sin_of(double cosine) { return std::sqrt(std::fmax(0.0, 1 - cosine * cosine)); }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) for angles in [0, pi].
+    static double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 1 : cos_a * cos_b + sin_a * sin_b;
+    }
+
+    static double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 0 : sin_a * cos_b - cos_a * sin_b;
+    }
+};
+
+// Smallest cone holding the normal cones of both.
+inline void merge_cones(const light_bounds& a, const light_bounds& b, vec3& axis, double& cos_theta) {
+    auto theta_a = std::acos(std::clamp(a.cos_theta_o, -1.0, 1.0));
+    auto theta_b = std::acos(std::clamp(b.cos_theta_o, -1.0, 1.0));
+    auto theta_d = std::acos(std::clamp(double(dot(a.axis, b.axis)), -1.0, 1.0));
+
+    if(std::fmin(theta_d + theta_b, pi) <= theta_a) {
+        axis = a.axis;
+        cos_theta = a.cos_theta_o;
+        return;
+    }
+    if(std::fmin(theta_d + theta_a, pi) <= theta_b) {
+        axis = b.axis;
+        cos_theta = b.cos_theta_o;
+        return;
+    }
+
+    auto theta_o = (theta_a + theta_d + theta_b) / 2;
+    auto rotation_axis = cross(a.axis, b.axis);
+    if(theta_o >= pi || rotation_axis.length_squared() <= 0) {
+        axis = a.axis;
+        cos_theta = -1;
+        return;
+    }
+
+    // Rotate a's axis towards b's by theta_o - theta_a; the rotation axis is perpendicular to it.
+    auto k = unit_vector(rotation_axis);
+    auto theta_r = theta_o - theta_a;
+    axis = unit_vector(std::cos(theta_r) * a.axis + std::sin(theta_r) * cross(k, a.axis));
+    cos_theta = std::cos(theta_o);
+}
+
+inline light_bounds merge(const light_bounds& a, const light_bounds& b) {
+    if(a.empty())
+        return b;
+    if(b.empty())
+        return a;
+
+    light_bounds m;
+    m.bounds = aabb(a.bounds, b.bounds);
+    m.power = a.power + b.power;
+    merge_cones(a, b, m.axis, m.cos_theta_o);
+    m.cos_theta_e = std::fmin(a.cos_theta_e, b.cos_theta_e);
+    m.two_sided = a.two_sided || b.two_sided;
+    return m;
+}
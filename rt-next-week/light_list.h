@@ -0,0 +1,242 @@
+#pragma once
+
+#include "environment.h"
+#include "hittable.h"
+#include "light_bounds.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// A light picked for a shading point and a direction towards it. pdf is the solid-angle density of the direction
+// including the probability of picking this light. A null light is the environment.
+struct light_sample {
+    const hittable* light = nullptr;
+    vec3 direction;
+    double pdf = 0;
+};
+
+// The emitters of a scene that direct lighting can sample, as collected by hittable::collect_lights, in a binary
+// hierarchy over their light_bounds. Sampling walks from the root and at each node picks a child in proportion to
+// its importance for the shading point, so bright, near lights facing the point are chosen more often and the cost
+// is logarithmic in the number of lights. Emitters without power are left out.
+//
+// An environment light, if there is one, is picked instead of the hierarchy half of the time.
+class light_list {
+  public:
+    light_list() = default;
+
+    explicit light_list(const hittable& world, const environment_light* environment = nullptr)
+        : environment(environment) {
+        std::vector<const hittable*> collected;
+        world.collect_lights(collected);
+
+        std::vector<light_bounds> bounds;
+        for(const auto* light : collected) {
+            auto b = light->emission_bounds();
+            if(b.empty())
+                continue;
+            lights.push_back(light);
+            bounds.push_back(b);
+        }
+        if(lights.empty()) {
+            tree_probability = environment ? 0 : 1;
+            return;
+        }
+        tree_probability = environment ? 0.5 : 1;
+
+        std::vector<std::uint32_t> order(lights.size());
+        for(std::uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        nodes.reserve(2 * lights.size() - 1);
+        build(bounds, order, 0, order.size(), none);
+    }
+
+    [[nodiscard]] bool empty() const { return lights.empty() && !environment; }
+    [[nodiscard]] size_t size() const { return lights.size(); }
+    [[nodiscard]] bool contains(const hittable* light) const { return leaf_of.count(light) != 0; }
+
+    // Picks a light for `origin` and a direction towards it. False if no light can contribute there.
+    bool sample(const point3& origin, light_sample& s) const {
+        if(environment && random_double() >= tree_probability) {
+            s.light = nullptr;
+            if(!environment->sample(s.direction, s.pdf))
+                return false;
+            s.pdf *= 1 - tree_probability;
+            return true;
+        }
+        if(lights.empty())
+            return false;
+
+        std::uint32_t index = 0;
+        double pmf = tree_probability;
+        while(!nodes[index].leaf) {
+            auto first = index + 1, second = nodes[index].child;
+            auto i0 = nodes[first].bounds.importance(origin);
+            auto i1 = nodes[second].bounds.importance(origin);
+            if(i0 <= 0 && i1 <= 0)
+                return false;
+
+            auto p0 = i0 / (i0 + i1);
+            if(random_double() < p0) {
+                index = first;
+                pmf *= p0;
+            } else {
+                index = second;
+                pmf *= 1 - p0;
+            }
+        }
+        if(index == 0 && nodes[0].bounds.importance(origin) <= 0)
+            return false;
+
+        s.light = lights[nodes[index].child];
+        s.direction = s.light->random(origin);
+        s.pdf = pmf * s.light->pdf_value(origin, s.direction);
+        return s.pdf > 0;
+    }
+
+    // Density with which sample() would produce `direction` by picking `light`, the emitter seen along it. Zero for
+    // anything that is not in the hierarchy.
+    [[nodiscard]] double pdf_value(const point3& origin, const vec3& direction, const hittable* light) const {
+        auto pmf = selection_probability(origin, light);
+        return pmf > 0 ? pmf * light->pdf_value(origin, direction) : 0;
+    }
+
+    // Density with which sample() would produce `direction` by picking the environment.
+    [[nodiscard]] double environment_pdf(const vec3& direction) const {
+        return environment ? (1 - tree_probability) * environment->pdf_value(direction) : 0;
+    }
+
+    // Probability that sample() picks `light` from `origin`, recomputed along the path from its leaf to the root.
+    [[nodiscard]] double selection_probability(const point3& origin, const hittable* light) const {
+        auto it = leaf_of.find(light);
+        if(it == leaf_of.end())
+            return 0;
+
+        auto index = it->second;
+        if(index == 0)
+            return nodes[0].bounds.importance(origin) > 0 ? tree_probability : 0;
+
+        double pmf = tree_probability;
+        while(index != 0) {
+            auto parent = nodes[index].parent;
+            auto first = parent + 1, second = nodes[parent].child;
+            auto i0 = nodes[first].bounds.importance(origin);
+            auto i1 = nodes[second].bounds.importance(origin);
+            auto mine = index == first ? i0 : i1;
+            if(mine <= 0)
+                return 0;
+            pmf *= mine / (i0 + i1);
+            index = parent;
+        }
+        return pmf;
+    }
+
+  private:
+    // Depth-first order: an interior node's first child follows it, `child` is the second. In a leaf, `child` is the
+    // light's index.
+    struct node {
+        light_bounds bounds;
+        std::uint32_t parent;
+        std::uint32_t child;
+        bool leaf;
+    };
+
+    static constexpr std::uint32_t none = ~std::uint32_t(0);
+    static constexpr int bucket_count = 12;
+
+    const environment_light* environment = nullptr;
+    double tree_probability = 1; // of sampling the hierarchy rather than the environment
+    std::vector<const hittable*> lights;
+    std::vector<node> nodes;
+    std::unordered_map<const hittable*, std::uint32_t> leaf_of;
+
+    std::uint32_t build(const std::vector<light_bounds>& bounds, std::vector<std::uint32_t>& order, size_t start,
+                        size_t end, std::uint32_t parent) {
+        auto index = std::uint32_t(nodes.size());
+        nodes.push_back({light_bounds(), parent, 0, false});
+
+        light_bounds all;
+        for(size_t i = start; i < end; i++)
+            all = merge(all, bounds[order[i]]);
+        nodes[index].bounds = all;
+
+        if(end - start == 1) {
+            nodes[index].leaf = true;
+            nodes[index].child = order[start];
+            leaf_of[lights[order[start]]] = index;
+            return index;
+        }
+
+        auto mid = split(bounds, order, start, end, all);
+        build(bounds, order, start, mid, index);
+        auto second = build(bounds, order, mid, end, index);
+        nodes[index].child = second;
+        return index;
+    }
+
+    // Binned split minimizing the orientation-weighted area cost over all three axes; the middle by count if the
+    // centers cannot be told apart.
+    size_t split(const std::vector<light_bounds>& bounds, std::vector<std::uint32_t>& order, size_t start, size_t end,
+                 const light_bounds& all) {
+        aabb centers = aabb::empty;
+        for(size_t i = start; i < end; i++) {
+            auto c = bounds[order[i]].center();
+            centers = aabb(centers, aabb(c, c));
+        }
+
+        std::array<double, 3> extent = {all.bounds.x.size(), all.bounds.y.size(), all.bounds.z.size()};
+        auto longest = std::max({extent[0], extent[1], extent[2]});
+
+        double best_cost = infinity;
+        int best_axis = -1, best_bucket = 0;
+        for(int axis = 0; axis < 3; axis++) {
+            const auto& range = centers.axis_interval(axis);
+            if(range.size() <= 0 || extent[axis] <= 0)
+                continue;
+
+            std::array<light_bounds, bucket_count> buckets;
+            for(size_t i = start; i < end; i++) {
+                const auto& b = bounds[order[i]];
+                auto& bucket = buckets[bucket_of(b, axis, range)];
+                bucket = merge(bucket, b);
+            }
+
+            auto axis_scale = longest / extent[axis];
+            for(int split_after = 0; split_after < bucket_count - 1; split_after++) {
+                light_bounds below, above;
+                for(int b = 0; b <= split_after; b++)
+                    below = merge(below, buckets[b]);
+                for(int b = split_after + 1; b < bucket_count; b++)
+                    above = merge(above, buckets[b]);
+
+                auto cost = below.cost(axis_scale) + above.cost(axis_scale);
+                if(!below.empty() && !above.empty() && cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bucket = split_after;
+                }
+            }
+        }
+
+        size_t mid = start + (end - start) / 2;
+        if(best_axis >= 0) {
+            const auto& range = centers.axis_interval(best_axis);
+            auto it = std::partition(order.begin() + start, order.begin() + end, [&](std::uint32_t i) {
+                return bucket_of(bounds[i], best_axis, range) <= best_bucket;
+            });
+            mid = size_t(it - order.begin());
+        }
+        if(mid == start || mid == end)
+            mid = start + (end - start) / 2;
+        return mid;
+    }
+
+    static int bucket_of(const light_bounds& b, int axis, const interval& range) {
+        auto bucket = int(bucket_count * (b.center()[axis] - range.min) / range.size());
+        return std::clamp(bucket, 0, bucket_count - 1);
+    }
+};
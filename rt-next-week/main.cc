@@ -4,15 +4,20 @@
 #include "material.h"
 #include "quad.h"
 #include "rtweekend.h"
+#include "scene_cache.h"
 
+#include "box.h"
 #include "bvh.h"
 #include "camera.h"
+#include "grid_medium.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "motion_bvh.h"
 #include "sphere.h"
 #include "texture.h"
 #include "vec3.h"
 #include <memory>
+#include <string>
 
 #define sio                                                                                                            \
     std::ios::sync_with_stdio(false);                                                                                  \
@@ -65,7 +70,7 @@ void bouncing_spheres() {
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(make_shared<motion_bvh>(world));
 
     camera cam;
 
@@ -235,12 +240,12 @@ void cornell_box() {
     world.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
     world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
 
-    shared_ptr<hittable> box1 = box(point3(0, 0, 0), point3(165, 330, 165), white);
+    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
     box1 = make_shared<rotate_y>(box1, 15);
     box1 = make_shared<translate>(box1, vec3(256, 0, 295));
     world.add(box1);
 
-    shared_ptr<hittable> box2 = box(point3(0, 0, 0), point3(165, 165, 165), white);
+    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
     box2 = make_shared<rotate_y>(box2, -18);
     box2 = make_shared<translate>(box2, vec3(130, 0, 65));
     world.add(box2);
@@ -278,11 +283,11 @@ void cornell_smoke() {
     world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
     world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
 
-    shared_ptr<hittable> box1 = box(point3(0, 0, 0), point3(165, 330, 165), white);
+    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
     box1 = make_shared<rotate_y>(box1, 15);
     box1 = make_shared<translate>(box1, vec3(265, 0, 295));
 
-    shared_ptr<hittable> box2 = box(point3(0, 0, 0), point3(165, 165, 165), white);
+    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
     box2 = make_shared<rotate_y>(box2, -18);
     box2 = make_shared<translate>(box2, vec3(130, 0, 65));
 
@@ -308,6 +313,42 @@ void cornell_smoke() {
     cam.render(world);
 }
 
+void cornell_cloud() {
+    hittable_list world;
+
+    auto red = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(7, 7, 7));
+
+    world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    world.add(make_shared<quad>(point3(113, 554, 127), vec3(330, 0, 0), vec3(0, 0, 305), light));
+    world.add(make_shared<quad>(point3(0, 555, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+
+    auto cloud = perlin_cloud(aabb(point3(80, 80, 100), point3(475, 475, 495)), 128, 1.0, 0.02);
+    world.add(make_shared<grid_medium>(cloud, color(1, 1, 1)));
+
+    camera cam;
+
+    cam.aspect_ratio = 1.0;
+    cam.image_width = 600;
+    cam.samples_per_pixel = 200;
+    cam.max_depth = 50;
+    cam.background = color(0, 0, 0);
+
+    cam.vfov = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat = point3(278, 278, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
 void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     hittable_list boxes1;
     auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
@@ -323,7 +364,7 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
             auto y1 = random_double(1, 101);
             auto z1 = z0 + w;
 
-            boxes1.add(box(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+            boxes1.add(make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
         }
     }
 
@@ -376,10 +417,65 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     cam.vup = vec3(0, 1, 0);
 
     cam.defocus_angle = 0;
+    cam.photon_passes = 64; // caustics under the glass sphere
 
     cam.render(world);
 }
 
+// Many small emitters: a wall of sign panels with random colors and brightness and a rig of small spherical lamps
+// above the floor.
+void light_rig() {
+    hittable_list world;
+
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    world.add(make_shared<quad>(point3(-500, 0, -500), vec3(1000, 0, 0), vec3(0, 0, 1100), white));
+    world.add(make_shared<quad>(point3(-500, 0, 600), vec3(1000, 0, 0), vec3(0, 600, 0), white));
+
+    hittable_list panels;
+    for(int i = 0; i < 48; i++) {
+        for(int j = 0; j < 32; j++) {
+            auto emit = random_double(0.5, 8) * color::random(0.1, 1);
+            auto corner = point3(-480 + 20 * i, 80 + 15 * j, 599);
+            panels.add(make_shared<quad>(corner, vec3(14, 0, 0), vec3(0, 10, 0), make_shared<diffuse_light>(emit)));
+        }
+    }
+    for(int i = 0; i < 256; i++) {
+        auto center = point3(random_double(-450, 450), random_double(350, 450), random_double(-300, 500));
+        panels.add(make_shared<sphere>(center, 3, make_shared<diffuse_light>(color(20, 18, 14))));
+    }
+    world.add(make_shared<bvh_node>(panels));
+
+    world.add(make_shared<sphere>(point3(-150, 80, 200), 80, white));
+    world.add(make_shared<sphere>(point3(150, 80, 150), 80, make_shared<metal>(color(0.8, 0.8, 0.9), 0.3)));
+    world.add(make_shared<box>(point3(-40, 0, -50), point3(60, 160, 50), white));
+
+    camera cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth = 20;
+    cam.background = color(0, 0, 0);
+
+    cam.vfov = 50;
+    cam.lookfrom = point3(0, 250, -700);
+    cam.lookat = point3(0, 200, 300);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
+void scene_from_file(const std::string& filename) {
+    camera cam;
+    auto world = scene_format::load_scene(filename, cam);
+    if(!world)
+        return;
+
+    cam.render(*world);
+}
+
 int main() {
     sio;
     switch(9) {
@@ -410,6 +506,18 @@ int main() {
     case 9:
         final_scene(800, 10000, 40);
         break;
+    case 10:
+        cornell_cloud();
+        break;
+    case 11:
+        scene_from_file("cornell_smoke.scene");
+        break;
+    case 12:
+        light_rig();
+        break;
+    case 13:
+        scene_from_file("environment_spheres.scene");
+        break;
     default:
         final_scene(400, 250, 4);
         break;
@@ -2,6 +2,7 @@
 
 #include "color.h"
 #include "hittable.h"
+#include "pdf.h"
 #include "ray.h"
 #include "rtweekend.h"
 #include "texture.h"
@@ -9,15 +10,59 @@
 #include <cmath>
 #include <memory>
 
+// What a material's sample() chose: the ray leaving the surface, the BSDF times the cosine divided by the density
+// of its direction, and that density. Mirrors and glass pick from a delta distribution and report a density of 0.
+struct scatter_sample {
+    ray scattered;
+    color weight;
+    double pdf = 0;
+};
+
+// Materials expose their scattering three ways. sample() draws an outgoing direction; eval() is the BSDF times the
+// cosine for a direction chosen elsewhere (towards a light) and pdf() the density sample() would have picked that
+// direction with. For every material that reports a density, weight == eval / pdf for what sample() returns.
 class material {
   public:
     virtual ~material() = default;
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
-        return false;
+    virtual bool sample(const ray& r_in, const hit_record& rec, scatter_sample& s) const { return false; }
+
+    [[nodiscard]] virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return {0, 0, 0};
+    }
+
+    [[nodiscard]] virtual double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return 0;
     }
 
     [[nodiscard]] virtual color emitted(double u, double v, const point3& p) const { return {}; }
+
+    [[nodiscard]] virtual bool emits() const { return false; }
+
+    // Whether the lobe is broad enough for path guiding to help; narrow and delta lobes are left to sample().
+    [[nodiscard]] virtual bool guidable() const { return false; }
+
+    // Whether this is a diffuse surface, where photon maps store the caustics arriving and gather them again.
+    [[nodiscard]] virtual bool diffuse() const { return false; }
+};
+
+// A material's sampling at one hit as a pdf, to mix with other strategies. generate() returns a zero vector where
+// the material absorbs instead.
+class material_pdf : public pdf {
+  public:
+    material_pdf(const material& mat, const ray& r_in, const hit_record& rec) : mat(mat), r_in(r_in), rec(rec) {}
+
+    [[nodiscard]] double value(const vec3& direction) const override { return mat.pdf(r_in, rec, direction); }
+
+    [[nodiscard]] vec3 generate() const override {
+        scatter_sample s;
+        return mat.sample(r_in, rec, s) ? s.scattered.direction() : vec3(0, 0, 0);
+    }
+
+  private:
+    const material& mat;
+    const ray& r_in;
+    const hit_record& rec;
 };
 
 class lambertian : public material {
@@ -25,17 +70,27 @@ class lambertian : public material {
     lambertian(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
     lambertian(shared_ptr<texture> tex) : tex(std::move(tex)) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+    bool sample(const ray& r_in, const hit_record& rec, scatter_sample& s) const override {
+        cosine_pdf lobe(rec.normal);
+        auto direction = lobe.generate();
+        s.scattered = ray(rec.spawn_origin(direction), direction, r_in.time());
+        s.weight = tex->filtered(rec.u, rec.v, rec.p, rec.footprint);
+        s.pdf = lobe.value(direction);
+        return true;
+    }
 
-        if(scatter_direction.near_zero())
-            scatter_direction = rec.normal;
+    [[nodiscard]] color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return pdf(r_in, rec, direction) * tex->filtered(rec.u, rec.v, rec.p, rec.footprint);
+    }
 
-        scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
-        return true;
+    // Sampled exactly in proportion to albedo / pi times the cosine.
+    [[nodiscard]] double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return cosine_pdf(rec.normal).value(direction);
     }
 
+    [[nodiscard]] bool guidable() const override { return true; }
+    [[nodiscard]] bool diffuse() const override { return true; }
+
   private:
     shared_ptr<texture> tex;
 };
@@ -44,25 +99,62 @@ class metal : public material {
   public:
     metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-        vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-        scattered = ray(rec.p, reflected, r_in.time());
-        attenuation = albedo;
-        return (dot(scattered.direction(), rec.normal) > 0);
+    bool sample(const ray& r_in, const hit_record& rec, scatter_sample& s) const override {
+        vec3 reflected = unit_vector(reflect(r_in.direction(), rec.normal));
+        vec3 direction = reflected + (fuzz * random_unit_vector());
+        if(direction.near_zero() || dot(direction, rec.normal) <= 0)
+            return false;
+
+        s.scattered = ray(rec.spawn_origin(direction), direction, r_in.time());
+        s.weight = albedo;
+        s.pdf = fuzz > 0 ? lobe_pdf(reflected, direction) : 0;
+        return true;
+    }
+
+    // The BSDF is defined by the sampling: albedo times the lobe's density above the surface, nothing below it.
+    [[nodiscard]] color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        if(dot(direction, rec.normal) <= 0)
+            return {0, 0, 0};
+        return pdf(r_in, rec, direction) * albedo;
+    }
+
+    [[nodiscard]] double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        if(fuzz <= 0)
+            return 0;
+        return lobe_pdf(unit_vector(reflect(r_in.direction(), rec.normal)), direction);
     }
 
   private:
     color albedo;
     double fuzz;
+
+    // Density of the direction of reflected + fuzz * (uniform point on the unit sphere), with |reflected| = 1. The
+    // line from the hit point along `direction` crosses that sphere of radius fuzz at up to two points in front of
+    // it; each brings the uniform area density 1 / (4 pi fuzz^2) converted to solid angle, t^2 / |cos|.
+    [[nodiscard]] double lobe_pdf(const vec3& reflected, const vec3& direction) const {
+        auto length = direction.length();
+        if(length <= 0)
+            return 0;
+
+        auto b = dot(reflected, direction) / length;
+        auto discriminant = b * b - 1 + fuzz * fuzz;
+        if(discriminant <= 0)
+            return 0;
+
+        auto root = std::sqrt(discriminant);
+        double sum = 0;
+        for(auto t : {b - root, b + root})
+            if(t > 0)
+                sum += t * t;
+        return sum / (4 * pi * fuzz * root);
+    }
 };
 
 class dielectric : public material {
   public:
     dielectric(double refraction_index) : refraction_index(refraction_index) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-        attenuation = color(1.0, 1.0, 1.0);
+    bool sample(const ray& r_in, const hit_record& rec, scatter_sample& s) const override {
         double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
 
         vec3 unit_direction = unit_vector(r_in.direction());
@@ -77,7 +169,9 @@ class dielectric : public material {
         else
             direction = refract(unit_direction, rec.normal, ri);
 
-        scattered = ray(rec.p, direction, r_in.time());
+        s.scattered = ray(rec.spawn_origin(direction), direction, r_in.time());
+        s.weight = color(1.0, 1.0, 1.0);
+        s.pdf = 0;
         return true;
     }
 
@@ -99,6 +193,8 @@ class diffuse_light : public material {
 
     [[nodiscard]] color emitted(double u, double v, const point3& p) const override { return tex->value(u, v, p); }
 
+    [[nodiscard]] bool emits() const override { return true; }
+
   private:
     shared_ptr<texture> tex;
 };
@@ -108,12 +204,25 @@ class isotropic : public material {
     isotropic(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
     isotropic(shared_ptr<texture> tex) : tex(std::move(tex)) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-        scattered = ray(rec.p, random_unit_vector(), r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+    bool sample(const ray& r_in, const hit_record& rec, scatter_sample& s) const override {
+        sphere_pdf phase;
+        auto direction = phase.generate();
+        s.scattered = ray(rec.p, direction, r_in.time());
+        s.weight = tex->filtered(rec.u, rec.v, rec.p, rec.footprint);
+        s.pdf = phase.value(direction);
         return true;
     }
 
+    [[nodiscard]] color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return pdf(r_in, rec, direction) * tex->filtered(rec.u, rec.v, rec.p, rec.footprint);
+    }
+
+    [[nodiscard]] double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return sphere_pdf().value(direction);
+    }
+
+    [[nodiscard]] bool guidable() const override { return true; }
+
   private:
     shared_ptr<texture> tex;
 };
@@ -0,0 +1,541 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "thread-pool.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Indexed triangle geometry with positions in structure-of-arrays form, shareable between mesh instances. Positions
+// are `real`, so the float build stores them at half the size.
+struct mesh_data {
+    std::vector<real> x, y, z;
+    std::vector<std::uint32_t> indices; // three per triangle
+
+    [[nodiscard]] size_t vertex_count() const { return x.size(); }
+    [[nodiscard]] size_t triangle_count() const { return indices.size() / 3; }
+};
+
+// Read-only memory mapping of a whole file.
+class mapped_file {
+  public:
+    mapped_file(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0)
+            return;
+
+        struct stat st {};
+        if(::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED) {
+                bytes = static_cast<const char*>(p);
+                length = size_t(st.st_size);
+                ::madvise(p, length, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+        if(bytes != nullptr)
+            ::munmap(const_cast<char*>(bytes), length);
+    }
+
+    [[nodiscard]] bool valid() const { return bytes != nullptr; }
+    [[nodiscard]] const char* data() const { return bytes; }
+    [[nodiscard]] size_t size() const { return length; }
+
+  private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+};
+
+namespace mesh_detail {
+
+inline size_t worker_count() {
+    auto n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// Runs job(begin, end) over [0, count) split into one contiguous range per worker.
+template <typename Job>
+void parallel_ranges(size_t count, size_t chunks, Job job) {
+    thread_pool pool(std::min(chunks, worker_count()));
+    for(size_t c = 0; c < chunks; c++)
+        pool.add_job([&job, c, count, chunks] { job(c, count * c / chunks, count * (c + 1) / chunks); });
+    pool.wait_for_completion();
+}
+
+inline const char* skip_spaces(const char* p, const char* end) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+inline const char* next_line(const char* p, const char* end) {
+    while(p < end && *p != '\n')
+        p++;
+    return p < end ? p + 1 : end;
+}
+
+// A face corner as written in the file: 1-based absolute, or negative and relative to the vertices seen so far.
+struct obj_corner {
+    std::int64_t index;
+    std::uint32_t vertices_before; // vertices of this chunk preceding the face, for resolving relative indices
+};
+
+struct obj_chunk {
+    std::vector<real> x, y, z;
+    std::vector<obj_corner> corners; // triangulated, three per triangle
+    bool ok = true;
+};
+
+inline void parse_obj_chunk(const char* p, const char* end, obj_chunk& out) {
+    std::vector<obj_corner> polygon;
+    while(p < end) {
+        p = skip_spaces(p, end);
+        if(end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            double v[3];
+            p += 2;
+            for(auto& c : v) {
+                p = skip_spaces(p, end);
+                if(p < end && *p == '+')
+                    p++;
+                auto res = std::from_chars(p, end, c);
+                if(res.ec != std::errc()) {
+                    out.ok = false;
+                    return;
+                }
+                p = res.ptr;
+            }
+            out.x.push_back(real(v[0]));
+            out.y.push_back(real(v[1]));
+            out.z.push_back(real(v[2]));
+        } else if(end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p += 2;
+            polygon.clear();
+            while(true) {
+                p = skip_spaces(p, end);
+                if(p >= end || *p == '\n' || *p == '#')
+                    break;
+                std::int64_t index;
+                auto res = std::from_chars(p, end, index);
+                if(res.ec != std::errc() || index == 0) {
+                    out.ok = false;
+                    return;
+                }
+                polygon.push_back({index, std::uint32_t(out.x.size())});
+                p = res.ptr;
+                while(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') // skip "/vt/vn"
+                    p++;
+            }
+            for(size_t i = 2; i < polygon.size(); i++) {
+                out.corners.push_back(polygon[0]);
+                out.corners.push_back(polygon[i - 1]);
+                out.corners.push_back(polygon[i]);
+            }
+        }
+        p = next_line(p, end);
+    }
+}
+
+enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64, invalid };
+
+inline ply_type parse_ply_type(const std::string& name) {
+    if(name == "char" || name == "int8")
+        return ply_type::int8;
+    if(name == "uchar" || name == "uint8")
+        return ply_type::uint8;
+    if(name == "short" || name == "int16")
+        return ply_type::int16;
+    if(name == "ushort" || name == "uint16")
+        return ply_type::uint16;
+    if(name == "int" || name == "int32")
+        return ply_type::int32;
+    if(name == "uint" || name == "uint32")
+        return ply_type::uint32;
+    if(name == "float" || name == "float32")
+        return ply_type::float32;
+    if(name == "double" || name == "float64")
+        return ply_type::float64;
+    return ply_type::invalid;
+}
+
+inline size_t ply_size(ply_type t) {
+    switch(t) {
+    case ply_type::int8:
+    case ply_type::uint8:
+        return 1;
+    case ply_type::int16:
+    case ply_type::uint16:
+        return 2;
+    case ply_type::int32:
+    case ply_type::uint32:
+    case ply_type::float32:
+        return 4;
+    case ply_type::float64:
+        return 8;
+    case ply_type::invalid:
+        break;
+    }
+    return 0;
+}
+
+template <typename T>
+T ply_load(const char* p, bool swap) {
+    unsigned char raw[sizeof(T)];
+    std::memcpy(raw, p, sizeof(T));
+    if(swap)
+        std::reverse(raw, raw + sizeof(T));
+    T value;
+    std::memcpy(&value, raw, sizeof(T));
+    return value;
+}
+
+inline double ply_read(const char* p, ply_type t, bool swap) {
+    switch(t) {
+    case ply_type::int8:
+        return ply_load<std::int8_t>(p, swap);
+    case ply_type::uint8:
+        return ply_load<std::uint8_t>(p, swap);
+    case ply_type::int16:
+        return ply_load<std::int16_t>(p, swap);
+    case ply_type::uint16:
+        return ply_load<std::uint16_t>(p, swap);
+    case ply_type::int32:
+        return ply_load<std::int32_t>(p, swap);
+    case ply_type::uint32:
+        return ply_load<std::uint32_t>(p, swap);
+    case ply_type::float32:
+        return ply_load<float>(p, swap);
+    case ply_type::float64:
+        return ply_load<double>(p, swap);
+    case ply_type::invalid:
+        break;
+    }
+    return 0;
+}
+
+struct ply_property {
+    std::string name;
+    ply_type type = ply_type::invalid;
+    ply_type count_type = ply_type::invalid; // set for list properties
+};
+
+inline bool is_vertex_index_list(const ply_property& prop) {
+    return prop.count_type != ply_type::invalid && (prop.name == "vertex_indices" || prop.name == "vertex_index");
+}
+
+struct ply_element {
+    std::string name;
+    size_t count = 0;
+    std::vector<ply_property> properties;
+};
+
+} // namespace mesh_detail
+
+// Wavefront OBJ: "v" and "f" records only; polygons are fan-triangulated, texture and normal indices are ignored.
+// The mapped file is split at line boundaries and the pieces are parsed concurrently.
+inline bool load_obj(const std::string& filename, mesh_data& mesh) {
+    using namespace mesh_detail;
+
+    mapped_file file(filename);
+    if(!file.valid()) {
+        std::cerr << "ERROR: Could not open mesh file '" << filename << "'.\n";
+        return false;
+    }
+
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+    size_t chunk_count = std::max<size_t>(1, std::min(worker_count() * 4, file.size() / (1 << 20)));
+
+    std::vector<const char*> cuts(chunk_count + 1, end);
+    cuts[0] = begin;
+    for(size_t c = 1; c < chunk_count; c++)
+        cuts[c] = std::max(cuts[c - 1], next_line(begin + file.size() * c / chunk_count - 1, end));
+
+    std::vector<obj_chunk> chunks(chunk_count);
+    parallel_ranges(chunk_count, chunk_count,
+                    [&](size_t c, size_t, size_t) { parse_obj_chunk(cuts[c], cuts[c + 1], chunks[c]); });
+
+    std::vector<size_t> vertex_offset(chunk_count + 1, 0);
+    std::vector<size_t> corner_offset(chunk_count + 1, 0);
+    for(size_t c = 0; c < chunk_count; c++) {
+        if(!chunks[c].ok) {
+            std::cerr << "ERROR: Malformed OBJ file '" << filename << "'.\n";
+            return false;
+        }
+        vertex_offset[c + 1] = vertex_offset[c] + chunks[c].x.size();
+        corner_offset[c + 1] = corner_offset[c] + chunks[c].corners.size();
+    }
+
+    auto vertex_total = vertex_offset[chunk_count];
+    mesh.x.resize(vertex_total);
+    mesh.y.resize(vertex_total);
+    mesh.z.resize(vertex_total);
+    mesh.indices.resize(corner_offset[chunk_count]);
+
+    std::atomic<bool> indices_ok{true};
+    parallel_ranges(chunk_count, chunk_count, [&](size_t c, size_t, size_t) {
+        const auto& chunk = chunks[c];
+        std::copy(chunk.x.begin(), chunk.x.end(), mesh.x.begin() + vertex_offset[c]);
+        std::copy(chunk.y.begin(), chunk.y.end(), mesh.y.begin() + vertex_offset[c]);
+        std::copy(chunk.z.begin(), chunk.z.end(), mesh.z.begin() + vertex_offset[c]);
+        for(size_t i = 0; i < chunk.corners.size(); i++) {
+            const auto& corner = chunk.corners[i];
+            auto index = corner.index > 0
+                             ? corner.index - 1
+                             : std::int64_t(vertex_offset[c] + corner.vertices_before) + corner.index;
+            if(index < 0 || size_t(index) >= vertex_total)
+                indices_ok = false;
+            mesh.indices[corner_offset[c] + i] = std::uint32_t(index);
+        }
+    });
+
+    if(!indices_ok) {
+        std::cerr << "ERROR: OBJ file '" << filename << "' references missing vertices.\n";
+        return false;
+    }
+    return true;
+}
+
+// Binary PLY (either endianness) with x/y/z vertex properties and a vertex index face list. Vertex records have
+// a fixed size and are decoded concurrently, as are faces when every face is a triangle.
+inline bool load_ply(const std::string& filename, mesh_data& mesh) {
+    using namespace mesh_detail;
+
+    mapped_file file(filename);
+    if(!file.valid()) {
+        std::cerr << "ERROR: Could not open mesh file '" << filename << "'.\n";
+        return false;
+    }
+
+    const char* p = file.data();
+    const char* end = p + file.size();
+
+    std::vector<ply_element> elements;
+    bool swap = false;
+    bool binary = false;
+    bool header_done = false;
+    while(p < end && !header_done) {
+        const char* line_end = next_line(p, end);
+        std::string line(p, line_end);
+        while(!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+            line.pop_back();
+        p = line_end;
+
+        std::vector<std::string> words;
+        for(size_t i = 0; i < line.size();) {
+            auto j = line.find(' ', i);
+            if(j == std::string::npos)
+                j = line.size();
+            if(j > i)
+                words.push_back(line.substr(i, j - i));
+            i = j + 1;
+        }
+        if(words.empty())
+            continue;
+
+        if(words[0] == "format" && words.size() >= 2) {
+            binary = words[1] != "ascii";
+            std::uint16_t probe = 1;
+            bool host_little = *reinterpret_cast<unsigned char*>(&probe) == 1;
+            swap = (words[1] == "binary_little_endian") != host_little;
+        } else if(words[0] == "element" && words.size() >= 3) {
+            char* count_end = nullptr;
+            auto count = std::strtoull(words[2].c_str(), &count_end, 10);
+            if(!std::isdigit(static_cast<unsigned char>(words[2][0])) || *count_end != '\0') {
+                std::cerr << "ERROR: Bad element count '" << words[2] << "' in PLY file '" << filename << "'.\n";
+                return false;
+            }
+            elements.push_back({words[1], size_t(count), {}});
+        } else if(words[0] == "property" && !elements.empty()) {
+            ply_property prop;
+            if(words.size() >= 5 && words[1] == "list") {
+                prop.count_type = parse_ply_type(words[2]);
+                prop.type = parse_ply_type(words[3]);
+                prop.name = words[4];
+            } else if(words.size() >= 3) {
+                prop.type = parse_ply_type(words[1]);
+                prop.name = words[2];
+            }
+            elements.back().properties.push_back(prop);
+        } else if(words[0] == "end_header") {
+            header_done = true;
+        }
+    }
+
+    if(!header_done || !binary) {
+        std::cerr << "ERROR: '" << filename << "' is not a binary PLY file.\n";
+        return false;
+    }
+
+    for(const auto& element : elements) {
+        bool fixed_size = true;
+        size_t record_size = 0;
+        for(const auto& prop : element.properties) {
+            if(prop.type == ply_type::invalid) {
+                std::cerr << "ERROR: Unsupported property type in PLY file '" << filename << "'.\n";
+                return false;
+            }
+            if(prop.count_type != ply_type::invalid)
+                fixed_size = false;
+            else
+                record_size += ply_size(prop.type);
+        }
+
+        if(element.name == "vertex") {
+            if(!fixed_size || (record_size > 0 && size_t(end - p) / record_size < element.count)) {
+                std::cerr << "ERROR: Unsupported vertex layout in PLY file '" << filename << "'.\n";
+                return false;
+            }
+
+            std::array<size_t, 3> offset{};
+            std::array<ply_type, 3> type = {ply_type::invalid, ply_type::invalid, ply_type::invalid};
+            size_t at = 0;
+            for(const auto& prop : element.properties) {
+                for(int axis = 0; axis < 3; axis++) {
+                    if(prop.name == std::string(1, char('x' + axis))) {
+                        offset[axis] = at;
+                        type[axis] = prop.type;
+                    }
+                }
+                at += ply_size(prop.type);
+            }
+            if(std::find(type.begin(), type.end(), ply_type::invalid) != type.end()) {
+                std::cerr << "ERROR: PLY file '" << filename << "' has no x/y/z vertex positions.\n";
+                return false;
+            }
+
+            mesh.x.resize(element.count);
+            mesh.y.resize(element.count);
+            mesh.z.resize(element.count);
+            const char* base = p;
+            parallel_ranges(element.count, worker_count() * 4, [&](size_t, size_t first, size_t last) {
+                for(size_t i = first; i < last; i++) {
+                    const char* record = base + i * record_size;
+                    mesh.x[i] = real(ply_read(record + offset[0], type[0], swap));
+                    mesh.y[i] = real(ply_read(record + offset[1], type[1], swap));
+                    mesh.z[i] = real(ply_read(record + offset[2], type[2], swap));
+                }
+            });
+            p += element.count * record_size;
+        } else if(element.name == "face") {
+            const auto& props = element.properties;
+            const bool triangle_fast_path = props.size() == 1 && is_vertex_index_list(props[0]) && element.count > 0;
+            const size_t count_size = triangle_fast_path ? ply_size(props[0].count_type) : 0;
+            const size_t index_size = triangle_fast_path ? ply_size(props[0].type) : 0;
+            const size_t stride = count_size + 3 * index_size;
+
+            // All-triangle meshes have a fixed face stride; check that in parallel and decode in place.
+            bool all_triangles = triangle_fast_path && size_t(end - p) / stride >= element.count;
+            if(all_triangles) {
+                std::vector<char> chunk_ok(worker_count() * 4, 1);
+                const char* base = p;
+                mesh.indices.resize(3 * element.count);
+                parallel_ranges(element.count, chunk_ok.size(), [&](size_t c, size_t first, size_t last) {
+                    for(size_t i = first; i < last; i++) {
+                        const char* record = base + i * stride;
+                        if(ply_read(record, props[0].count_type, swap) != 3) {
+                            chunk_ok[c] = 0;
+                            return;
+                        }
+                        for(size_t k = 0; k < 3; k++)
+                            mesh.indices[3 * i + k] =
+                                std::uint32_t(ply_read(record + count_size + k * index_size, props[0].type, swap));
+                    }
+                });
+                all_triangles = std::find(chunk_ok.begin(), chunk_ok.end(), 0) == chunk_ok.end();
+                if(all_triangles)
+                    p += element.count * stride;
+            }
+
+            if(!all_triangles) {
+                mesh.indices.clear();
+                std::vector<std::uint32_t> polygon;
+                auto truncated = [&] {
+                    std::cerr << "ERROR: Truncated PLY file '" << filename << "'.\n";
+                    return false;
+                };
+                for(size_t i = 0; i < element.count; i++) {
+                    for(const auto& prop : props) {
+                        if(prop.count_type == ply_type::invalid) {
+                            if(size_t(end - p) < ply_size(prop.type))
+                                return truncated();
+                            p += ply_size(prop.type);
+                            continue;
+                        }
+                        if(size_t(end - p) < ply_size(prop.count_type))
+                            return truncated();
+                        auto n = size_t(ply_read(p, prop.count_type, swap));
+                        p += ply_size(prop.count_type);
+                        if(size_t(end - p) / ply_size(prop.type) < n)
+                            return truncated();
+                        polygon.clear();
+                        for(size_t k = 0; k < n; k++, p += ply_size(prop.type))
+                            polygon.push_back(std::uint32_t(ply_read(p, prop.type, swap)));
+                        if(!is_vertex_index_list(prop))
+                            continue;
+                        for(size_t k = 2; k < polygon.size(); k++) {
+                            mesh.indices.push_back(polygon[0]);
+                            mesh.indices.push_back(polygon[k - 1]);
+                            mesh.indices.push_back(polygon[k]);
+                        }
+                    }
+                }
+            }
+        } else {
+            // Skip elements we don't use; only fixed-size ones can be skipped without decoding.
+            if(!fixed_size) {
+                std::cerr << "ERROR: Unsupported element '" << element.name << "' in PLY file '" << filename
+                          << "'.\n";
+                return false;
+            }
+            if(record_size > 0 && size_t(end - p) / record_size < element.count) {
+                std::cerr << "ERROR: Truncated PLY file '" << filename << "'.\n";
+                return false;
+            }
+            p += element.count * record_size;
+        }
+    }
+
+    for(auto index : mesh.indices) {
+        if(index >= mesh.vertex_count()) {
+            std::cerr << "ERROR: PLY file '" << filename << "' references missing vertices.\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Picks the loader from the file extension.
+inline bool load_mesh(const std::string& filename, mesh_data& mesh) {
+    auto dot = filename.rfind('.');
+    auto ext = dot == std::string::npos ? std::string() : filename.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+
+    if(ext == "obj")
+        return load_obj(filename, mesh);
+    if(ext == "ply")
+        return load_ply(filename, mesh);
+
+    std::cerr << "ERROR: Unknown mesh format for '" << filename << "'.\n";
+    return false;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "color.h"
+#include "rtw_image.h"
+#include "rtweekend.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// An 8-bit RGB image with its chain of box-filtered half-resolution levels down to a single texel, all in one
+// buffer. Lookups blend the two levels whose texels are nearest the requested footprint (trilinear filtering), so a
+// minified texture reads a few neighbouring texels of a small level instead of scattered ones of the full image.
+class mip_map {
+  public:
+    mip_map() = default;
+
+    explicit mip_map(const rtw_image& image) {
+        int width = image.width(), height = image.height();
+        if(width <= 0 || height <= 0)
+            return;
+
+        levels.push_back({width, height, 0});
+        texels.resize(size_t(width) * height * 3);
+        for(int y = 0; y < height; y++)
+            std::copy_n(image.pixel_data(0, y), size_t(width) * 3, texels.begin() + size_t(y) * width * 3);
+
+        while(width > 1 || height > 1) {
+            const auto source = levels.back();
+            width = std::max(1, (width + 1) / 2);
+            height = std::max(1, (height + 1) / 2);
+            levels.push_back({width, height, texels.size()});
+            texels.resize(texels.size() + size_t(width) * height * 3);
+
+            // Odd sizes repeat their last row or column.
+            for(int y = 0; y < height; y++) {
+                int y0 = std::min(2 * y, source.height - 1), y1 = std::min(2 * y + 1, source.height - 1);
+                for(int x = 0; x < width; x++) {
+                    int x0 = std::min(2 * x, source.width - 1), x1 = std::min(2 * x + 1, source.width - 1);
+                    auto* out = &texels[levels.back().offset + (size_t(y) * width + x) * 3];
+                    for(int c = 0; c < 3; c++) {
+                        int sum = texels[index(source, x0, y0) + c] + texels[index(source, x1, y0) + c] +
+                                  texels[index(source, x0, y1) + c] + texels[index(source, x1, y1) + c];
+                        out[c] = static_cast<unsigned char>((sum + 2) / 4);
+                    }
+                }
+            }
+        }
+        texel_size = 1 / std::sqrt(double(levels[0].width) * levels[0].height);
+    }
+
+    [[nodiscard]] bool empty() const { return levels.empty(); }
+
+    // Color at (u, v), v running down the image, filtered over a footprint `width` across in (u, v) units; 0 reads
+    // the full resolution.
+    [[nodiscard]] color lookup(double u, double v, double width) const {
+        if(levels.empty())
+            return {0, 0, 0};
+
+        auto level = width > texel_size ? std::log2(width / texel_size) : 0.0;
+        auto last = double(levels.size() - 1);
+        if(level >= last)
+            return bilinear(levels.back(), u, v);
+
+        auto fine = int(level);
+        auto blend = level - fine;
+        if(blend <= 0)
+            return bilinear(levels[fine], u, v);
+        return (1 - blend) * bilinear(levels[fine], u, v) + blend * bilinear(levels[fine + 1], u, v);
+    }
+
+  private:
+    struct level_data {
+        int width, height;
+        size_t offset;
+    };
+
+    std::vector<level_data> levels;
+    std::vector<unsigned char> texels;
+    double texel_size = 1; // of the full resolution, in (u, v) units
+
+    [[nodiscard]] static size_t index(const level_data& l, int x, int y) {
+        return l.offset + (size_t(y) * l.width + x) * 3;
+    }
+
+    // Between the four texels around (u, v), clamped at the edges.
+    [[nodiscard]] color bilinear(const level_data& l, double u, double v) const {
+        auto x = std::fmin(std::fmax(u, 0.0), 1.0) * l.width - 0.5;
+        auto y = std::fmin(std::fmax(v, 0.0), 1.0) * l.height - 0.5;
+        auto x0 = int(std::floor(x)), y0 = int(std::floor(y));
+        auto fx = x - x0, fy = y - y0;
+        auto x1 = std::min(x0 + 1, l.width - 1), y1 = std::min(y0 + 1, l.height - 1);
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+
+        const auto* t00 = &texels[index(l, x0, y0)];
+        const auto* t10 = &texels[index(l, x1, y0)];
+        const auto* t01 = &texels[index(l, x0, y1)];
+        const auto* t11 = &texels[index(l, x1, y1)];
+        color result;
+        for(int c = 0; c < 3; c++) {
+            auto top = (1 - fx) * t00[c] + fx * t10[c];
+            auto bottom = (1 - fx) * t01[c] + fx * t11[c];
+            result[c] = ((1 - fy) * top + fy * bottom) / 255.0;
+        }
+        return result;
+    }
+};
@@ -0,0 +1,320 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "interval.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+// BVH for scenes with motion blur. Every node stores its bounds at both ends of the time range it covers, and a ray
+// tests the box interpolated to its own time instead of the box swept over the whole shutter. Where objects move
+// far enough that interpolated boxes still overlap badly, the builder can split the time range instead of the
+// objects (a multi-segment motion BVH); each half then gets a hierarchy fitted to the motion within it.
+class motion_bvh : public hittable {
+  public:
+    motion_bvh(const hittable_list& list) : motion_bvh(list.objects) {}
+
+    motion_bvh(std::vector<shared_ptr<hittable>> objects) : objects(std::move(objects)) {
+        std::vector<motion_box> boxes;
+        boxes.reserve(this->objects.size());
+        bbox = aabb::empty;
+        for(const auto& object : this->objects) {
+            boxes.push_back({object->bounding_box_at(0), object->bounding_box_at(1)});
+            bbox = aabb(bbox, object->bounding_box());
+        }
+
+        std::vector<std::uint32_t> ids(this->objects.size());
+        for(size_t i = 0; i < ids.size(); i++)
+            ids[i] = std::uint32_t(i);
+
+        nodes.emplace_back();
+        if(!ids.empty())
+            build(0, boxes, ids, 0, 1, 0, 0);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+        traverse(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            for(auto i = first; i < first + count; i++) {
+                if(objects[refs[i]]->hit(r, t, rec)) {
+                    hit_anything = true;
+                    t.max = rec.t;
+                }
+            }
+            return false;
+        });
+        return hit_anything;
+    }
+
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        return traverse(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            for(auto i = first; i < first + count; i++)
+                if(objects[refs[i]]->occluded(r, t))
+                    return true;
+            return false;
+        });
+    }
+
+    [[nodiscard]] double transmittance(const ray& r, interval ray_t) const override {
+        double fraction = 1;
+        traverse(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            for(auto i = first; i < first + count && fraction > 0; i++)
+                fraction *= objects[refs[i]]->transmittance(r, t);
+            return fraction <= 0;
+        });
+        return fraction;
+    }
+
+    [[nodiscard]] aabb bounding_box() const override { return bbox; }
+
+    void collect_lights(std::vector<const hittable*>& lights) const override {
+        for(const auto& object : objects)
+            object->collect_lights(lights);
+    }
+
+    [[nodiscard]] aabb bounding_box_at(double time) const override {
+        return nodes.empty() ? bbox : lerp(nodes[0].start, nodes[0].end, time);
+    }
+
+    void print_stats(std::ostream& out) const {
+        size_t time_splits = 0;
+        for(const auto& n : nodes)
+            time_splits += n.kind == node_kind::time_split;
+        out << "motion_bvh: " << objects.size() << " objects, " << nodes.size() << " nodes (" << time_splits
+            << " time splits), " << refs.size() << " leaf references\n";
+    }
+
+  private:
+    struct motion_box {
+        aabb start, end;
+    };
+
+    enum class node_kind : std::uint8_t { leaf, spatial, time_split };
+
+    struct node {
+        aabb start, end;              // bounds at t0 and t1
+        double t0 = 0, inv_span = 1;  // time range the bounds belong to
+        double split_time = 0;        // time_split: the first child covers [t0, split_time)
+        std::uint32_t index = 0;      // leaf: first entry in refs; otherwise first of two adjacent children
+        std::uint32_t count = 0;      // leaf: number of objects
+        node_kind kind = node_kind::leaf;
+        std::uint8_t axis = 0;        // spatial: the first child holds the lower centroids along this axis
+
+        [[nodiscard]] aabb at(double time) const {
+            return lerp(start, end, std::clamp((time - t0) * inv_span, 0.0, 1.0));
+        }
+    };
+
+    static constexpr size_t max_leaf_size = 4;
+    static constexpr int max_time_splits = 3;
+    static constexpr int bin_count = 12;
+    static constexpr int max_depth = 48; // keeps the traversal stack bounded
+
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<node> nodes;
+    std::vector<std::uint32_t> refs; // leaf contents; time splits may list an object in several leaves
+    aabb bbox;
+
+    // Calls leaf(first, count, t) on every leaf whose interpolated box the ray enters, nearest boxes first, until it
+    // returns true. The callback shrinks t.max as it finds closer hits.
+    template <typename Leaf> bool traverse(const ray& r, interval ray_t, Leaf&& leaf) const {
+        if(objects.empty() || !nodes[0].at(r.time()).hit(r, ray_t))
+            return false;
+
+        std::array<std::uint32_t, 64> stack;
+        int top = 0;
+        stack[top++] = 0;
+
+        while(top > 0) {
+            const node& n = nodes[stack[--top]];
+            switch(n.kind) {
+            case node_kind::leaf:
+                if(leaf(n.index, n.count, ray_t))
+                    return true;
+                break;
+            case node_kind::time_split: {
+                auto child = n.index + (r.time() < n.split_time ? 0 : 1);
+                if(nodes[child].at(r.time()).hit(r, ray_t))
+                    stack[top++] = child;
+                break;
+            }
+            case node_kind::spatial: {
+                bool hit0 = nodes[n.index].at(r.time()).hit(r, ray_t);
+                bool hit1 = nodes[n.index + 1].at(r.time()).hit(r, ray_t);
+                // Push the far child first so the near one is popped next.
+                bool near_second = r.direction()[n.axis] < 0;
+                if(hit0 && hit1) {
+                    stack[top++] = n.index + (near_second ? 0 : 1);
+                    stack[top++] = n.index + (near_second ? 1 : 0);
+                } else if(hit0 || hit1) {
+                    stack[top++] = n.index + (hit0 ? 0 : 1);
+                }
+                break;
+            }
+            }
+        }
+        return false;
+    }
+
+    static double center(const aabb& box, int axis) {
+        const auto& ax = box.axis_interval(axis);
+        return 0.5 * (ax.min + ax.max);
+    }
+
+    static double area(const aabb& box) {
+        auto dx = box.x.size(), dy = box.y.size(), dz = box.z.size();
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    // Average surface area over the node's time range (the area of a linearly moving box is quadratic in time;
+    // the endpoint average is close enough for cost estimates).
+    static double motion_area(const motion_box& b) { return 0.5 * (area(b.start) + area(b.end)); }
+
+    static motion_box merge(const motion_box& a, const motion_box& b) {
+        return {aabb(a.start, b.start), aabb(a.end, b.end)};
+    }
+
+    // Boxes of every object over the sub-range [t0, t1] of the shutter.
+    static motion_box narrow(const motion_box& b, double t0, double t1) {
+        return {lerp(b.start, b.end, t0), lerp(b.start, b.end, t1)};
+    }
+
+    void build(std::uint32_t index, const std::vector<motion_box>& boxes, std::vector<std::uint32_t>& ids, double t0,
+               double t1, int time_splits, int depth) {
+        motion_box bounds{aabb::empty, aabb::empty};
+        aabb centroids = aabb::empty;
+        for(auto id : ids) {
+            auto b = narrow(boxes[id], t0, t1);
+            bounds = merge(bounds, b);
+            auto mid = lerp(b.start, b.end, 0.5);
+            point3 c(center(mid, 0), center(mid, 1), center(mid, 2));
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        nodes[index].start = bounds.start;
+        nodes[index].end = bounds.end;
+        nodes[index].t0 = t0;
+        nodes[index].inv_span = 1.0 / (t1 - t0);
+
+        auto make_leaf = [&] {
+            nodes[index].kind = node_kind::leaf;
+            nodes[index].index = std::uint32_t(refs.size());
+            nodes[index].count = std::uint32_t(ids.size());
+            refs.insert(refs.end(), ids.begin(), ids.end());
+        };
+
+        if(ids.size() <= 1 || depth >= max_depth) {
+            make_leaf();
+            return;
+        }
+
+        // Binned SAH over the centroids at mid-range, with areas averaged over the range.
+        const auto parent_area = motion_area(bounds);
+        double best_cost = infinity;
+        int best_axis = -1, best_bin = 0;
+        for(int axis = 0; axis < 3; axis++) {
+            const auto& extent = centroids.axis_interval(axis);
+            if(extent.size() <= 0)
+                continue;
+
+            std::array<motion_box, bin_count> bin_box;
+            std::array<size_t, bin_count> bin_size{};
+            bin_box.fill({aabb::empty, aabb::empty});
+            for(auto id : ids) {
+                int bin = bin_of(boxes[id], t0, t1, axis, extent);
+                bin_box[bin] = merge(bin_box[bin], narrow(boxes[id], t0, t1));
+                bin_size[bin]++;
+            }
+
+            std::array<double, bin_count> right_cost{};
+            motion_box acc{aabb::empty, aabb::empty};
+            size_t count = 0;
+            for(int b = bin_count - 1; b > 0; b--) {
+                acc = merge(acc, bin_box[b]);
+                count += bin_size[b];
+                right_cost[b] = count ? motion_area(acc) * double(count) : 0;
+            }
+
+            acc = {aabb::empty, aabb::empty};
+            count = 0;
+            for(int b = 0; b < bin_count - 1; b++) {
+                acc = merge(acc, bin_box[b]);
+                count += bin_size[b];
+                if(count == 0 || count == ids.size())
+                    continue;
+                auto cost = motion_area(acc) * double(count) + right_cost[b + 1];
+                if(cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        // Splitting time: each half is visited by half the rays and holds every object, fitted to its half.
+        double time_cost = infinity;
+        const double mid_time = 0.5 * (t0 + t1);
+        if(time_splits < max_time_splits) {
+            motion_box first{aabb::empty, aabb::empty}, second{aabb::empty, aabb::empty};
+            for(auto id : ids) {
+                first = merge(first, narrow(boxes[id], t0, mid_time));
+                second = merge(second, narrow(boxes[id], mid_time, t1));
+            }
+            time_cost = 0.5 * (motion_area(first) + motion_area(second)) * double(ids.size());
+        }
+
+        const auto leaf_cost = double(ids.size());
+        const auto split_cost = 1 + std::min(best_cost, time_cost) / parent_area;
+        if(ids.size() <= max_leaf_size && leaf_cost <= split_cost) {
+            make_leaf();
+            return;
+        }
+
+        auto children = std::uint32_t(nodes.size());
+        nodes.emplace_back();
+        nodes.emplace_back();
+        nodes[index].index = children;
+
+        if(time_cost < best_cost) {
+            nodes[index].kind = node_kind::time_split;
+            nodes[index].split_time = mid_time;
+            std::vector<std::uint32_t> second_ids = ids;
+            build(children, boxes, ids, t0, mid_time, time_splits + 1, depth + 1);
+            build(children + 1, boxes, second_ids, mid_time, t1, time_splits + 1, depth + 1);
+            return;
+        }
+
+        std::vector<std::uint32_t> left, right;
+        if(best_axis >= 0) {
+            const auto& extent = centroids.axis_interval(best_axis);
+            for(auto id : ids)
+                (bin_of(boxes[id], t0, t1, best_axis, extent) <= best_bin ? left : right).push_back(id);
+        } else {
+            // All centroids coincide: halve the list.
+            left.assign(ids.begin(), ids.begin() + ids.size() / 2);
+            right.assign(ids.begin() + ids.size() / 2, ids.end());
+        }
+
+        ids.clear();
+        ids.shrink_to_fit();
+        nodes[index].kind = node_kind::spatial;
+        nodes[index].axis = std::uint8_t(best_axis >= 0 ? best_axis : centroids.longest_axis());
+        build(children, boxes, left, t0, t1, time_splits, depth + 1);
+        build(children + 1, boxes, right, t0, t1, time_splits, depth + 1);
+    }
+
+    static int bin_of(const motion_box& box, double t0, double t1, int axis, const interval& extent) {
+        auto mid = lerp(box.start, box.end, 0.5 * (t0 + t1));
+        auto c = center(mid, axis);
+        auto bin = int(bin_count * (c - extent.min) / extent.size());
+        return std::clamp(bin, 0, bin_count - 1);
+    }
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include <cmath>
+
+// A distribution of directions leaving a point: generate() draws one, value() is the solid-angle density of a
+// given direction. Directions need not be unit length.
+class pdf {
+  public:
+    virtual ~pdf() = default;
+
+    [[nodiscard]] virtual double value(const vec3& direction) const = 0;
+    [[nodiscard]] virtual vec3 generate() const = 0;
+};
+
+// Uniform over the whole sphere.
+class sphere_pdf : public pdf {
+  public:
+    [[nodiscard]] double value(const vec3& direction) const override { return 1 / (4 * pi); }
+
+    [[nodiscard]] vec3 generate() const override { return random_unit_vector(); }
+};
+
+// Density cos(theta) / pi over the hemisphere about `normal`. A unit normal plus a uniform point on the unit sphere
+// lands on the sphere through the origin tangent to the surface, and projects to exactly this distribution.
+class cosine_pdf : public pdf {
+  public:
+    explicit cosine_pdf(const vec3& normal) : normal(normal) {}
+
+    [[nodiscard]] double value(const vec3& direction) const override {
+        auto length = direction.length();
+        if(length <= 0)
+            return 0;
+        auto cosine = dot(normal, direction) / length;
+        return cosine <= 0 ? 0 : cosine / pi;
+    }
+
+    [[nodiscard]] vec3 generate() const override {
+        auto direction = normal + random_unit_vector();
+        return direction.near_zero() ? normal : direction;
+    }
+
+  private:
+    vec3 normal;
+};
+
+// One-sample combination of two strategies: draws from the first with probability `weight`, and the density of a
+// direction is the weighted sum, which is the balance heuristic's denominator. Dividing by it weights every
+// direction by how likely either strategy was to produce it.
+class mixture_pdf : public pdf {
+  public:
+    mixture_pdf(const pdf& first, const pdf& second, double weight = 0.5)
+        : first(first), second(second), weight(weight) {}
+
+    [[nodiscard]] double value(const vec3& direction) const override {
+        return weight * first.value(direction) + (1 - weight) * second.value(direction);
+    }
+
+    [[nodiscard]] vec3 generate() const override {
+        return random_double() < weight ? first.generate() : second.generate();
+    }
+
+  private:
+    const pdf& first;
+    const pdf& second;
+    double weight;
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "alias_table.h"
+#include "color.h"
+#include "hittable.h"
+#include "interval.h"
+#include "material.h"
+#include "pdf.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Light that reached a diffuse surface at p through glass or mirrors only, travelling along `direction`, carrying
+// `power` (flux).
+struct photon {
+    point3 p;
+    vec3 direction;
+    color power;
+};
+
+// Photons in a uniform grid of cells twice the search radius across, hashed into buckets, so that the photons
+// within the radius of a point lie in the few cells its search box overlaps. Photons are sorted by bucket and each
+// bucket is a range of them.
+class photon_map {
+  public:
+    photon_map() = default;
+
+    photon_map(std::vector<photon> stored, double radius)
+        : radius(radius), inverse_cell_size(1 / (2 * radius)) {
+        std::uint32_t buckets = 1;
+        while(buckets < 2 * stored.size())
+            buckets <<= 1;
+        mask = buckets - 1;
+
+        std::vector<std::uint32_t> bucket_of(stored.size());
+        start.assign(buckets + 1, 0);
+        for(size_t i = 0; i < stored.size(); i++) {
+            bucket_of[i] = bucket(cell(stored[i].p.x()), cell(stored[i].p.y()), cell(stored[i].p.z()));
+            start[bucket_of[i] + 1]++;
+        }
+        for(size_t b = 1; b < start.size(); b++)
+            start[b] += start[b - 1];
+
+        photons.resize(stored.size());
+        auto next = start;
+        for(size_t i = 0; i < stored.size(); i++)
+            photons[next[bucket_of[i]]++] = stored[i];
+    }
+
+    [[nodiscard]] bool empty() const { return photons.empty(); }
+    [[nodiscard]] double search_radius() const { return radius; }
+
+    // Calls visit(photon) for every photon within the search radius of p.
+    template <typename Visit> void gather(const point3& p, Visit&& visit) const {
+        if(photons.empty())
+            return;
+
+        // The box spans two cells per axis, or three where rounding carries an end across a cell boundary.
+        std::array<std::uint32_t, 27> visited;
+        int count = 0;
+        auto x0 = cell(p.x() - radius), y0 = cell(p.y() - radius), z0 = cell(p.z() - radius);
+        auto x1 = cell(p.x() + radius), y1 = cell(p.y() + radius), z1 = cell(p.z() + radius);
+        auto radius_squared = radius * radius;
+        for(auto x = x0; x <= x1; x++) {
+            for(auto y = y0; y <= y1; y++) {
+                for(auto z = z0; z <= z1; z++) {
+                    // Distinct cells can share a bucket, which must be searched once.
+                    auto b = bucket(x, y, z);
+                    if(std::find(visited.begin(), visited.begin() + count, b) != visited.begin() + count)
+                        continue;
+                    visited[count++] = b;
+
+                    for(auto i = start[b]; i < start[b + 1]; i++)
+                        if((photons[i].p - p).length_squared() <= radius_squared)
+                            visit(photons[i]);
+                }
+            }
+        }
+    }
+
+    // A radius holding about `neighbours` photons around the typical stored one: the median distance to the
+    // neighbours-th nearest photon, over up to 256 of them.
+    static double suggest_radius(const std::vector<photon>& stored, int neighbours = 20) {
+        if(stored.size() <= size_t(neighbours))
+            return 0;
+
+        std::vector<double> distances(stored.size()), nearest;
+        auto stride = std::max<size_t>(1, stored.size() / 256);
+        for(size_t i = 0; i < stored.size(); i += stride) {
+            for(size_t j = 0; j < stored.size(); j++)
+                distances[j] = (stored[j].p - stored[i].p).length_squared();
+            std::nth_element(distances.begin(), distances.begin() + neighbours, distances.end());
+            nearest.push_back(std::sqrt(distances[neighbours]));
+        }
+        std::nth_element(nearest.begin(), nearest.begin() + nearest.size() / 2, nearest.end());
+        return nearest[nearest.size() / 2];
+    }
+
+  private:
+    std::vector<photon> photons;
+    std::vector<std::uint32_t> start; // photons of bucket b are [start[b], start[b + 1])
+    std::uint32_t mask = 0;
+    double radius = 0;
+    double inverse_cell_size = 0;
+
+    [[nodiscard]] std::int64_t cell(double coordinate) const {
+        return std::int64_t(std::floor(coordinate * inverse_cell_size));
+    }
+
+    [[nodiscard]] std::uint32_t bucket(std::int64_t x, std::int64_t y, std::int64_t z) const {
+        auto h = std::uint64_t(x) * 73856093u ^ std::uint64_t(y) * 19349663u ^ std::uint64_t(z) * 83492791u;
+        return std::uint32_t(h ^ (h >> 32)) & mask;
+    }
+};
+
+// Emits photons from the scene's diffuse_light emitters, picked in proportion to their power, and follows them
+// through delta bounces (glass, perfect mirrors). A photon is stored where it then lands on a diffuse surface;
+// photons that land there directly, or meet anything else first, are direct or indirect light the path tracer
+// already handles and are dropped.
+class photon_tracer {
+  public:
+    photon_tracer() = default;
+
+    explicit photon_tracer(const hittable& world) {
+        std::vector<const hittable*> collected;
+        world.collect_lights(collected);
+
+        std::vector<double> powers;
+        hit_record rec;
+        double area;
+        for(const auto* light : collected) {
+            auto bounds = light->emission_bounds();
+            if(bounds.empty() || !light->sample_surface(rec, area))
+                continue;
+            lights.push_back(light);
+            two_sided.push_back(bounds.two_sided);
+            powers.push_back(bounds.power);
+            sources.insert(light);
+        }
+        table = alias_table(powers);
+    }
+
+    [[nodiscard]] bool empty() const { return table.empty(); }
+
+    // Whether `light` emits photons, so that caustics from it come from the photon map.
+    [[nodiscard]] bool emits_photons(const hittable* light) const { return sources.count(light) != 0; }
+
+    // Traces one of `count` photons of a pass, appending it to `stored` if it becomes a caustic photon.
+    void trace(const hittable& world, int max_depth, int count, std::vector<photon>& stored) const {
+        auto index = table.sample();
+        hit_record rec;
+        double area;
+        if(!lights[index]->sample_surface(rec, area))
+            return;
+
+        // Cosine-weighted emission: the cosine cancels, leaving radiance times pi times the area, over the chances
+        // of this light and this face.
+        auto normal = rec.normal;
+        double faces = two_sided[index] ? 2 : 1;
+        if(two_sided[index] && random_double() < 0.5)
+            normal = -normal;
+        auto direction = cosine_pdf(normal).generate();
+        color power = (faces * pi * area / (table.probability(index) * count)) * rec.mat->emitted(rec.u, rec.v, rec.p);
+
+        ray r(rec.spawn_origin(direction), direction, real(random_double()));
+        bool through_specular = false;
+        for(int depth = 0; depth < max_depth; depth++) {
+            hit_record hit;
+            if(!world.hit(r, interval(surface_epsilon(r.origin()), infinity), hit))
+                return;
+            hit.finalize(r);
+
+            if(hit.mat->diffuse()) {
+                if(through_specular)
+                    stored.push_back({hit.p, unit_vector(r.direction()), power});
+                return;
+            }
+
+            scatter_sample s;
+            if(!hit.mat->sample(r, hit, s) || s.pdf > 0)
+                return;
+            power = power * s.weight;
+            through_specular = true;
+            r = s.scattered;
+        }
+    }
+
+  private:
+    std::vector<const hittable*> lights;
+    std::vector<bool> two_sided;
+    std::unordered_set<const hittable*> sources;
+    alias_table table;
+};
@@ -2,12 +2,13 @@
 
 #include "aabb.h"
 #include "hittable.h"
-#include "hittable_list.h"
 #include "interval.h"
+#include "material.h"
 #include "rtweekend.h"
 #include "vec3.h"
 #include <cmath>
 #include <memory>
+#include <vector>
 
 class quad : public hittable {
   public:
@@ -17,6 +18,7 @@ class quad : public hittable {
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n, n);
+        area = n.length();
 
         set_bouding_box();
     }
@@ -30,32 +32,82 @@ class quad : public hittable {
     [[nodiscard]] aabb bounding_box() const override { return bbox; }
 
     [[nodiscard]] bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        auto denom = dot(normal, r.direction());
-
-        if(std::fabs(denom) < 1e-8)
+        real t, alpha, beta;
+        if(!plane_hit(r, ray_t, t, alpha, beta))
             return false;
 
-        auto t = (D - dot(normal, r.origin())) / denom;
-        if(!ray_t.contains(t))
-            return false;
-
-        auto intersection = r.at(t);
-        vec3 planar_hitpt_vector = intersection - Q;
-        auto alpha = dot(w, cross(planar_hitpt_vector, v));
-        auto beta = dot(w, cross(u, planar_hitpt_vector));
-
         if(!is_interior(alpha, beta, rec))
             return false;
 
         rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
+        rec.object = this;
+        return true;
+    }
+
+    void finalize(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.mat = mat.get();
         rec.set_face_normal(r, normal);
+        rec.texture_scale = 1 / std::sqrt(area);
+    }
+
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        real t, alpha, beta;
+        if(!plane_hit(r, ray_t, t, alpha, beta))
+            return false;
+
+        hit_record rec;
+        return is_interior(alpha, beta, rec);
+    }
+
+    void collect_lights(std::vector<const hittable*>& lights) const override {
+        if(mat->emits())
+            lights.push_back(this);
+    }
 
+    // Uniform over the area, converted to solid angle.
+    [[nodiscard]] double pdf_value(const point3& origin, const vec3& direction) const override {
+        real t, alpha, beta;
+        hit_record rec;
+        if(!plane_hit(ray(origin, direction), interval(surface_epsilon(origin), infinity), t, alpha, beta) ||
+           !is_interior(alpha, beta, rec))
+            return 0;
+
+        auto distance_squared = t * t * direction.length_squared();
+        auto cosine = std::fabs(dot(direction, normal)) / direction.length();
+        return distance_squared / (cosine * area);
+    }
+
+    [[nodiscard]] vec3 random(const point3& origin) const override {
+        auto p = Q + (random_double() * u) + (random_double() * v);
+        return p - origin;
+    }
+
+    bool sample_surface(hit_record& rec, double& total_area) const override {
+        rec.u = random_double();
+        rec.v = random_double();
+        rec.p = Q + (rec.u * u) + (rec.v * v);
+        rec.p_error = rounding_error(max_abs(rec.p));
+        rec.normal = normal;
+        rec.front_face = true;
+        rec.mat = mat.get();
+        total_area = area;
         return true;
     }
 
-    virtual bool is_interior(double a, double b, hit_record& rec) const {
+    // Diffuse lights shine from both faces.
+    [[nodiscard]] light_bounds emission_bounds() const override {
+        auto center = Q + 0.5 * (u + v);
+        auto radiance = mat->emitted(0.5, 0.5, center);
+        light_bounds b;
+        b.bounds = bbox;
+        b.axis = normal;
+        b.power = std::fmax(radiance.x(), std::fmax(radiance.y(), radiance.z())) * area * pi * 2;
+        b.two_sided = true;
+        return b;
+    }
+
+    virtual bool is_interior(real a, real b, hit_record& rec) const {
         interval unit_interval(0, 1);
 
         if(!unit_interval.contains(a) || !unit_interval.contains(b))
@@ -73,25 +125,22 @@ class quad : public hittable {
     shared_ptr<material> mat;
     aabb bbox;
     vec3 normal;
-    double D;
-};
-
-inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat) {
-    auto sides = make_shared<hittable_list>();
+    real D;
+    real area;
 
-    auto min = point3(std::fmin(a.x(), b.x()), std::fmin(a.y(), b.y()), std::fmin(a.z(), b.z()));
-    auto max = point3(std::fmax(a.x(), b.x()), std::fmax(a.y(), b.y()), std::fmax(a.z(), b.z()));
+    bool plane_hit(const ray& r, const interval& ray_t, real& t, real& alpha, real& beta) const {
+        auto denom = dot(normal, r.direction());
 
-    auto dx = vec3(max.x() - min.x(), 0, 0);
-    auto dy = vec3(0, max.y() - min.y(), 0);
-    auto dz = vec3(0, 0, max.z() - min.z());
+        if(std::fabs(denom) < 1e-8)
+            return false;
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()), dx, dy, mat));  // front
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz, dy, mat)); // right
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx, dy, mat)); // back
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dz, dy, mat));  // left
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()), dx, -dz, mat)); // top
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dx, dz, mat));  // bottom
+        t = (D - dot(normal, r.origin())) / denom;
+        if(!ray_t.contains(t))
+            return false;
 
-    return sides;
-}
+        vec3 planar_hitpt_vector = r.at(t) - Q;
+        alpha = dot(w, cross(planar_hitpt_vector, v));
+        beta = dot(w, cross(u, planar_hitpt_vector));
+        return true;
+    }
+};
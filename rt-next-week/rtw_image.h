@@ -12,7 +12,8 @@ class rtw_image {
   public:
     rtw_image() = default;
 
-    rtw_image(const std::string& image_filename) {
+    // HDR users that only read float_pixel_data can skip the byte copy with with_bytes = false.
+    rtw_image(const std::string& image_filename, bool with_bytes = true) : with_bytes(with_bytes) {
         auto imagedir = getenv("RTW_IMAGES");
 
         if(imagedir && load(std::string(imagedir) + "/" + image_filename))
@@ -49,7 +50,8 @@ class rtw_image {
             return false;
 
         bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
+        if(with_bytes)
+            convert_to_bytes();
         return true;
     }
 
@@ -67,8 +69,21 @@ class rtw_image {
         return bdata + y * bytes_per_scanline + x * bytes_per_pixel;
     }
 
+    // Linear RGB as loaded: radiance for HDR files, gamma-decoded values for 8-bit ones.
+    [[nodiscard]] const float* float_pixel_data(int x, int y) const {
+        static std::array<float, 3> magenta = {1, 0, 1};
+        if(fdata == nullptr)
+            return magenta.data();
+
+        x = clamp(x, 0, image_width);
+        y = clamp(y, 0, image_height);
+
+        return fdata + y * bytes_per_scanline + x * bytes_per_pixel;
+    }
+
   private:
     const int bytes_per_pixel = 3;
+    bool with_bytes = true;
     float* fdata = nullptr;
     unsigned char* bdata = nullptr;
     int image_width = 0;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
 #include <memory>
 
@@ -8,6 +10,14 @@
 using std::make_shared;
 using std::shared_ptr;
 
+// Scalar type of the geometry: vectors, rays, intervals, boxes and hit records. Defining RT_SINGLE_PRECISION builds
+// the renderer in float.
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
 const double infinity = std::numeric_limits<double>::infinity();
 constexpr double pi = 3.1415926535897932385;
 
@@ -22,3 +32,19 @@ inline double random_double() {
 inline double random_double(double min, double max) { return min + (max - min) * random_double(); }
 
 inline int random_int(int min, int max) { return int(random_double(min, max + 1)); }
+
+template <typename Point> inline real max_abs(const Point& p) {
+    return real(std::max({std::fabs(p[0]), std::fabs(p[1]), std::fabs(p[2])}));
+}
+
+// Bound on the rounding error of a value computed in a handful of operations from values of size `magnitude`.
+inline real rounding_error(real magnitude) { return 8 * std::numeric_limits<real>::epsilon() * magnitude; }
+
+// Smallest distance that stays distinct from zero next to coordinates of size `magnitude`: a fixed 0.001, or a few
+// dozen ulps once that is larger, as it quickly is in float.
+inline real min_separation(real magnitude) {
+    return std::max(real(0.001), 64 * std::numeric_limits<real>::epsilon() * magnitude);
+}
+
+// Smallest ray parameter that safely leaves a surface at `p`.
+template <typename Point> inline real surface_epsilon(const Point& p) { return min_separation(max_abs(p)); }
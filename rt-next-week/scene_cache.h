@@ -0,0 +1,239 @@
+#pragma once
+
+#include "camera.h"
+#include "compressed_bvh.h"
+#include "hittable.h"
+#include "mesh_loader.h"
+#include "scene_file.h"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+// Compiled form of a scene file: a header followed by the record arrays of the description and the world BVH,
+// every section 8-byte aligned. Loading maps the file and reads the records in place; nothing is parsed and the
+// BVH is not rebuilt. The layout is the in-memory one, so a cache is only valid for the build that wrote it; the
+// header records the record sizes and the size of `real` to catch a mismatch, and the size and modification time of
+// the scene file it was compiled from to catch edits.
+namespace scene_format {
+
+using world_bvh = quantized_bvh<std::uint8_t>;
+
+struct cache_section {
+    std::uint64_t offset = 0;
+    std::uint64_t count = 0;
+};
+
+// Identifies one version of a scene file. Compared for equality, so an edit within the same second, or going back
+// to an older copy of the file, still invalidates the cache.
+struct source_stamp {
+    std::uint64_t size = 0;
+    std::int64_t mtime_ns = 0;
+
+    bool operator==(const source_stamp& other) const { return size == other.size && mtime_ns == other.mtime_ns; }
+};
+
+struct cache_header {
+    std::array<char, 8> magic{'R', 'T', 'S', 'C', 'E', 'N', 'E', '4'};
+    // sizeof(real) too: the records are the same size in the float build, but the BVH's quantized boxes are only
+    // conservative against the root box in the precision they were built in.
+    std::array<std::uint32_t, 8> record_sizes{sizeof(camera_record),  sizeof(texture_record),
+                                              sizeof(material_record), sizeof(shape_record),
+                                              sizeof(transform_record), sizeof(medium_record),
+                                              sizeof(world_bvh::node), sizeof(real)};
+    source_stamp source;
+    std::uint32_t root = 0;
+    std::array<double, 6> bounds{};
+    camera_record camera;
+    cache_section textures, materials, shapes, transforms, media, strings, nodes, order;
+};
+
+namespace detail {
+
+template <typename T> cache_section write_section(std::ofstream& out, const T* data, size_t count) {
+    auto position = std::uint64_t(out.tellp());
+    auto aligned = (position + 7) & ~std::uint64_t(7);
+    for(; position < aligned; position++)
+        out.put('\0');
+
+    out.write(reinterpret_cast<const char*>(data), std::streamsize(count * sizeof(T)));
+    return {aligned, count};
+}
+
+template <typename T>
+bool read_section(const mapped_file& file, const cache_section& section, const T*& data, size_t& count) {
+    if(section.offset % alignof(T) != 0 || section.offset > file.size() ||
+       section.count > (file.size() - section.offset) / sizeof(T))
+        return false;
+    data = reinterpret_cast<const T*>(file.data() + section.offset);
+    count = size_t(section.count);
+    return true;
+}
+
+// Size and modification time of `filename`, false if it cannot be read.
+inline bool stat_source(const std::string& filename, source_stamp& stamp) {
+    struct stat st {};
+    if(::stat(filename.c_str(), &st) != 0)
+        return false;
+#if defined(__APPLE__)
+    const auto& mtime = st.st_mtimespec;
+#else
+    const auto& mtime = st.st_mtim;
+#endif
+    stamp.size = std::uint64_t(st.st_size);
+    stamp.mtime_ns = std::int64_t(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+    return true;
+}
+
+} // namespace detail
+
+// Writes the scene's records and `tree`, the world BVH built over its top-level objects, to `filename`. `source`
+// stamps the scene file the records were parsed from.
+inline bool write_scene_cache(const scene_description& scene, const world_bvh& tree, const source_stamp& source,
+                              const std::string& filename) {
+    std::ofstream out(filename, std::ios::binary);
+    if(!out) {
+        std::cerr << "ERROR: Could not write scene cache '" << filename << "'.\n";
+        return false;
+    }
+
+    cache_header header;
+    header.source = source;
+    header.root = tree.root_ref();
+    const auto& b = tree.bounds();
+    header.bounds = {b.x.min, b.y.min, b.z.min, b.x.max, b.y.max, b.z.max};
+    header.camera = scene.camera;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    header.textures = detail::write_section(out, scene.textures.data(), scene.textures.size());
+    header.materials = detail::write_section(out, scene.materials.data(), scene.materials.size());
+    header.shapes = detail::write_section(out, scene.shapes.data(), scene.shapes.size());
+    header.transforms = detail::write_section(out, scene.transforms.data(), scene.transforms.size());
+    header.media = detail::write_section(out, scene.media.data(), scene.media.size());
+    header.strings = detail::write_section(out, scene.strings.data(), scene.strings.size());
+    header.nodes = detail::write_section(out, tree.node_array().data(), tree.node_array().size());
+    header.order = detail::write_section(out, tree.primitive_order().data(), tree.primitive_order().size());
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    return bool(out);
+}
+
+// A mapped cache file. The scene view points into the mapping, so it stays valid as long as this object does.
+class scene_cache {
+  public:
+    explicit scene_cache(const std::string& filename) : file(filename) {
+        if(!file.valid() || file.size() < sizeof(cache_header))
+            return;
+
+        std::memcpy(&header, file.data(), sizeof(header));
+        if(header.magic != cache_header().magic || header.record_sizes != cache_header().record_sizes)
+            return;
+
+        view.camera = &header.camera;
+        ok = detail::read_section(file, header.textures, view.textures, view.texture_count) &&
+             detail::read_section(file, header.materials, view.materials, view.material_count) &&
+             detail::read_section(file, header.shapes, view.shapes, view.shape_count) &&
+             detail::read_section(file, header.transforms, view.transforms, view.transform_count) &&
+             detail::read_section(file, header.media, view.media, view.medium_count) &&
+             detail::read_section(file, header.strings, view.strings, view.string_bytes) &&
+             detail::read_section(file, header.nodes, nodes, node_count) &&
+             detail::read_section(file, header.order, order, order_count);
+
+        // Everything below reads the mapping without further checks, so a truncated or corrupted file has to fail
+        // here: the tree must stay within its arrays, and the strings must end in a terminator, so that any offset
+        // below string_bytes reads a whole string.
+        ok = ok && world_bvh::well_formed(header.root, nodes, node_count, order_count) &&
+             (view.string_bytes == 0 || view.strings[view.string_bytes - 1] == '\0');
+    }
+
+    [[nodiscard]] bool valid() const { return ok; }
+    [[nodiscard]] const source_stamp& source() const { return header.source; }
+    [[nodiscard]] const scene_view& records() const { return view; }
+
+    // The world, with the stored BVH taken over as is.
+    [[nodiscard]] shared_ptr<hittable> world() const {
+        auto objects = instantiate(view).objects;
+        if(order_count != objects.size())
+            return nullptr;
+
+        std::vector<shared_ptr<hittable>> ordered;
+        ordered.reserve(objects.size());
+        for(size_t i = 0; i < order_count; i++) {
+            if(order[i] >= objects.size())
+                return nullptr;
+            ordered.push_back(objects[order[i]]);
+        }
+
+        world_bvh tree;
+        const auto& b = header.bounds;
+        tree.restore(header.root, aabb(point3(b[0], b[1], b[2]), point3(b[3], b[4], b[5])), nodes, node_count, order,
+                     order_count);
+        return make_shared<compressed_bvh<std::uint8_t>>(std::move(tree), std::move(ordered));
+    }
+
+  private:
+    mapped_file file;
+    cache_header header;
+    scene_view view;
+    const world_bvh::node* nodes = nullptr;
+    const std::uint32_t* order = nullptr;
+    size_t node_count = 0;
+    size_t order_count = 0;
+    bool ok = false;
+};
+
+// Sets up `cam` from a cache file and returns its world, or null if the cache cannot be used or was compiled from
+// another version of the scene file than `source`.
+inline shared_ptr<hittable> load_scene_cache(const std::string& filename, const source_stamp& source, camera& cam) {
+    scene_cache cache(filename);
+    if(!cache.valid() || !(cache.source() == source))
+        return nullptr;
+
+    auto world = cache.world();
+    if(world)
+        apply_camera(cache.records(), cam);
+    return world;
+}
+
+// Loads a scene file through its cache `<filename>.bin`, compiling the cache first when it is missing, stale or
+// written by an incompatible build. Sets up `cam` and returns the world, or null if the scene file could not be
+// read.
+inline shared_ptr<hittable> load_scene(const std::string& filename, camera& cam) {
+    const auto cache_name = filename + ".bin";
+    source_stamp source;
+    if(detail::stat_source(filename, source))
+        if(auto world = load_scene_cache(cache_name, source, cam))
+            return world;
+
+    scene_description scene;
+    if(!parse_scene(filename, scene))
+        return nullptr;
+
+    // The objects built for the BVH are the ones rendered, so image textures are only loaded once.
+    auto objects = instantiate(scene_view(scene)).objects;
+    std::vector<aabb> boxes;
+    boxes.reserve(objects.size());
+    for(const auto& object : objects)
+        boxes.push_back(object->bounding_box());
+
+    world_bvh tree;
+    tree.build(boxes);
+    // Without a cache the scene still renders; it is just parsed again next time.
+    write_scene_cache(scene, tree, source, cache_name);
+
+    std::vector<shared_ptr<hittable>> ordered;
+    ordered.reserve(objects.size());
+    for(auto index : tree.primitive_order())
+        ordered.push_back(objects[index]);
+
+    apply_camera(scene_view(scene), cam);
+    return make_shared<compressed_bvh<std::uint8_t>>(std::move(tree), std::move(ordered));
+}
+
+} // namespace scene_format
@@ -0,0 +1,586 @@
+#pragma once
+
+#include "affine.h"
+#include "box.h"
+#include "camera.h"
+#include "constant_medium.h"
+#include "environment.h"
+#include "hittable.h"
+#include "material.h"
+#include "quad.h"
+#include "rtweekend.h"
+#include "sphere.h"
+#include "texture.h"
+#include "vec3.h"
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Text scene description, one statement per line ('#' starts a comment):
+//
+//   camera aspect <a> | width <px> | samples <n> | depth <n> | background <r g b> | vfov <deg>
+//   camera lookfrom <x y z> | lookat <x y z> | vup <x y z> | defocus <angle> <focus distance>
+//   environment <image file> [<scale>]    (lights the scene from all around, in place of the background)
+//   texture <name> solid <r g b> | checker <scale> <even> <odd> | noise <scale> | image <file>
+//   material <name> lambertian <tex> | metal <r g b> <fuzz> | dielectric <ior> | light <tex> | isotropic <tex>
+//   sphere <material> <x y z> <radius> [to <x y z>]
+//   quad <material> <Q> <u> <v>
+//   box <material> <corner> <opposite corner>
+//   medium <density> <tex> <shape line without the material>
+//
+// <tex> is a texture name or an inline color. Shapes may end with transforms, applied left to right:
+// translate <x y z>, rotate_y <deg>, rotate <axis x y z> <deg>, scale <x y z>.
+//
+// Parsing produces plain records without pointers, which is also exactly what the binary scene cache stores.
+namespace scene_format {
+
+constexpr std::uint32_t none = ~std::uint32_t(0);
+
+enum class texture_kind : std::uint32_t { solid, checker, noise, image };
+enum class material_kind : std::uint32_t { lambertian, metal, dielectric, diffuse_light, isotropic };
+enum class shape_kind : std::uint32_t { sphere, quad, box };
+
+struct camera_record {
+    double aspect_ratio = 1.0;
+    std::int32_t image_width = 100;
+    std::int32_t samples_per_pixel = 10;
+    std::int32_t max_depth = 10;
+    std::array<double, 3> background{0, 0, 0};
+    double vfov = 90;
+    std::array<double, 3> lookfrom{0, 0, 0};
+    std::array<double, 3> lookat{0, 0, -1};
+    std::array<double, 3> vup{0, 1, 0};
+    double defocus_angle = 0;
+    double focus_dist = 10;
+    std::uint32_t environment = none; // offset of the image file name in the string table
+    double environment_scale = 1;
+};
+
+struct texture_record {
+    texture_kind kind = texture_kind::solid;
+    std::uint32_t even = none, odd = none; // checker
+    std::uint32_t filename = none;         // image: offset into the string table
+    double scale = 1;
+    std::array<double, 3> rgb{0, 0, 0};
+};
+
+struct material_record {
+    material_kind kind = material_kind::lambertian;
+    std::uint32_t tex = none;
+    double param = 0; // metal: fuzz, dielectric: refraction index
+    std::array<double, 3> rgb{0, 0, 0};
+};
+
+struct shape_record {
+    shape_kind kind = shape_kind::sphere;
+    std::uint32_t material = none;  // none: only the boundary of a medium
+    std::uint32_t transform = none; // index of its object-to-world matrix, if it has one
+    std::array<double, 9> p{};      // sphere: center, end center, radius; quad: Q, u, v; box: two corners
+};
+
+using transform_record = std::array<std::array<double, 4>, 3>;
+
+struct medium_record {
+    double density = 0;
+    std::uint32_t boundary = none; // shape index
+    std::uint32_t tex = none;
+};
+
+struct scene_description {
+    camera_record camera;
+    std::vector<texture_record> textures;
+    std::vector<material_record> materials;
+    std::vector<shape_record> shapes;
+    std::vector<transform_record> transforms;
+    std::vector<medium_record> media;
+    std::string strings; // null-terminated, referenced by offset
+};
+
+// Read-only view of the record arrays, over a scene_description or straight over a mapped cache file.
+struct scene_view {
+    const camera_record* camera = nullptr;
+    const texture_record* textures = nullptr;
+    size_t texture_count = 0;
+    const material_record* materials = nullptr;
+    size_t material_count = 0;
+    const shape_record* shapes = nullptr;
+    size_t shape_count = 0;
+    const transform_record* transforms = nullptr;
+    size_t transform_count = 0;
+    const medium_record* media = nullptr;
+    size_t medium_count = 0;
+    const char* strings = nullptr;
+    size_t string_bytes = 0;
+
+    scene_view() = default;
+
+    explicit scene_view(const scene_description& scene)
+        : camera(&scene.camera), textures(scene.textures.data()), texture_count(scene.textures.size()),
+          materials(scene.materials.data()), material_count(scene.materials.size()), shapes(scene.shapes.data()),
+          shape_count(scene.shapes.size()), transforms(scene.transforms.data()),
+          transform_count(scene.transforms.size()), media(scene.media.data()), medium_count(scene.media.size()),
+          strings(scene.strings.data()), string_bytes(scene.strings.size()) {}
+};
+
+namespace detail {
+
+class line_parser {
+  public:
+    line_parser(const std::string& filename, int line_number, const std::string& line)
+        : filename(filename), line_number(line_number), in(line) {}
+
+    bool word(std::string& out) {
+        if(in >> out)
+            return true;
+        return fail("unexpected end of line");
+    }
+
+    bool number(double& out) {
+        std::string token;
+        if(!(in >> token))
+            return fail("expected a number");
+        char* end = nullptr;
+        out = std::strtod(token.c_str(), &end);
+        if(end == token.c_str() || *end != '\0')
+            return fail("expected a number, got '" + token + "'");
+        return true;
+    }
+
+    bool number(std::int32_t& out) {
+        double value;
+        if(!number(value))
+            return false;
+        out = std::int32_t(value);
+        return true;
+    }
+
+    template <size_t N> bool numbers(std::array<double, N>& out, size_t first = 0, size_t count = N) {
+        for(size_t i = first; i < first + count; i++)
+            if(!number(out[i]))
+                return false;
+        return true;
+    }
+
+    bool vector(vec3& out) {
+        std::array<double, 3> v;
+        if(!numbers(v))
+            return false;
+        out = vec3(v[0], v[1], v[2]);
+        return true;
+    }
+
+    // Next token without consuming it; empty at the end of the line.
+    std::string peek() {
+        auto position = in.tellg();
+        std::string token;
+        if(!(in >> token))
+            token.clear();
+        in.clear();
+        in.seekg(position);
+        return token;
+    }
+
+    [[nodiscard]] bool at_end() { return peek().empty(); }
+
+    bool fail(const std::string& message) const {
+        std::cerr << "ERROR: " << filename << ":" << line_number << ": " << message << ".\n";
+        return false;
+    }
+
+  private:
+    const std::string& filename;
+    int line_number;
+    std::istringstream in;
+};
+
+inline bool is_number(const std::string& token) {
+    char* end = nullptr;
+    std::strtod(token.c_str(), &end);
+    return !token.empty() && end != token.c_str() && *end == '\0';
+}
+
+class scene_parser {
+  public:
+    scene_parser(const std::string& filename, scene_description& scene) : filename(filename), scene(scene) {}
+
+    bool parse_line(int line_number, const std::string& line) {
+        line_parser in(filename, line_number, line.substr(0, line.find('#')));
+        if(in.at_end())
+            return true;
+
+        std::string keyword;
+        in.word(keyword);
+        bool ok = keyword == "camera"        ? parse_camera(in)
+                  : keyword == "environment" ? parse_environment(in)
+                  : keyword == "texture"     ? parse_texture(in)
+                  : keyword == "material"    ? parse_material(in)
+                  : keyword == "medium"      ? parse_medium(in)
+                                             : parse_shape(in, keyword, true);
+        if(ok && !in.at_end())
+            return in.fail("unexpected '" + in.peek() + "'");
+        return ok;
+    }
+
+  private:
+    const std::string& filename;
+    scene_description& scene;
+    std::map<std::string, std::uint32_t> texture_names;
+    std::map<std::string, std::uint32_t> material_names;
+
+    bool parse_camera(line_parser& in) {
+        auto& cam = scene.camera;
+        std::string key;
+        if(!in.word(key))
+            return false;
+        if(key == "aspect")
+            return in.number(cam.aspect_ratio);
+        if(key == "width")
+            return in.number(cam.image_width);
+        if(key == "samples")
+            return in.number(cam.samples_per_pixel);
+        if(key == "depth")
+            return in.number(cam.max_depth);
+        if(key == "background")
+            return in.numbers(cam.background);
+        if(key == "vfov")
+            return in.number(cam.vfov);
+        if(key == "lookfrom")
+            return in.numbers(cam.lookfrom);
+        if(key == "lookat")
+            return in.numbers(cam.lookat);
+        if(key == "vup")
+            return in.numbers(cam.vup);
+        if(key == "defocus")
+            return in.number(cam.defocus_angle) && in.number(cam.focus_dist);
+        return in.fail("unknown camera setting '" + key + "'");
+    }
+
+    bool parse_environment(line_parser& in) {
+        auto& cam = scene.camera;
+        std::string file;
+        if(!in.word(file))
+            return false;
+        cam.environment = string_ref(file);
+        cam.environment_scale = 1;
+        return in.at_end() || in.number(cam.environment_scale);
+    }
+
+    std::uint32_t string_ref(const std::string& text) {
+        auto offset = std::uint32_t(scene.strings.size());
+        scene.strings += text;
+        scene.strings += '\0';
+        return offset;
+    }
+
+    // A texture name, or an inline color that becomes an anonymous solid texture.
+    bool texture_ref(line_parser& in, std::uint32_t& index) {
+        if(is_number(in.peek())) {
+            texture_record tex;
+            if(!in.numbers(tex.rgb))
+                return false;
+            index = std::uint32_t(scene.textures.size());
+            scene.textures.push_back(tex);
+            return true;
+        }
+
+        std::string name;
+        if(!in.word(name))
+            return false;
+        auto found = texture_names.find(name);
+        if(found == texture_names.end())
+            return in.fail("unknown texture '" + name + "'");
+        index = found->second;
+        return true;
+    }
+
+    bool parse_texture(line_parser& in) {
+        std::string name, kind;
+        if(!in.word(name) || !in.word(kind))
+            return false;
+
+        texture_record tex;
+        bool ok;
+        if(kind == "solid") {
+            ok = in.numbers(tex.rgb);
+        } else if(kind == "checker") {
+            tex.kind = texture_kind::checker;
+            ok = in.number(tex.scale) && texture_ref(in, tex.even) && texture_ref(in, tex.odd);
+        } else if(kind == "noise") {
+            tex.kind = texture_kind::noise;
+            ok = in.number(tex.scale);
+        } else if(kind == "image") {
+            tex.kind = texture_kind::image;
+            std::string file;
+            ok = in.word(file);
+            tex.filename = string_ref(file);
+        } else {
+            return in.fail("unknown texture type '" + kind + "'");
+        }
+        if(!ok)
+            return false;
+
+        texture_names[name] = std::uint32_t(scene.textures.size());
+        scene.textures.push_back(tex);
+        return true;
+    }
+
+    bool parse_material(line_parser& in) {
+        std::string name, kind;
+        if(!in.word(name) || !in.word(kind))
+            return false;
+
+        material_record mat;
+        bool ok;
+        if(kind == "lambertian") {
+            ok = texture_ref(in, mat.tex);
+        } else if(kind == "metal") {
+            mat.kind = material_kind::metal;
+            ok = in.numbers(mat.rgb) && in.number(mat.param);
+        } else if(kind == "dielectric") {
+            mat.kind = material_kind::dielectric;
+            ok = in.number(mat.param);
+        } else if(kind == "light") {
+            mat.kind = material_kind::diffuse_light;
+            ok = texture_ref(in, mat.tex);
+        } else if(kind == "isotropic") {
+            mat.kind = material_kind::isotropic;
+            ok = texture_ref(in, mat.tex);
+        } else {
+            return in.fail("unknown material type '" + kind + "'");
+        }
+        if(!ok)
+            return false;
+
+        material_names[name] = std::uint32_t(scene.materials.size());
+        scene.materials.push_back(mat);
+        return true;
+    }
+
+    bool parse_medium(line_parser& in) {
+        medium_record medium;
+        std::string shape;
+        if(!in.number(medium.density) || !texture_ref(in, medium.tex) || !in.word(shape))
+            return false;
+        if(!parse_shape(in, shape, false))
+            return false;
+
+        medium.boundary = std::uint32_t(scene.shapes.size() - 1);
+        scene.media.push_back(medium);
+        return true;
+    }
+
+    bool parse_shape(line_parser& in, const std::string& keyword, bool with_material) {
+        shape_record shape;
+        if(with_material) {
+            std::string name;
+            if(keyword != "sphere" && keyword != "quad" && keyword != "box")
+                return in.fail("unknown statement '" + keyword + "'");
+            if(!in.word(name))
+                return false;
+            auto found = material_names.find(name);
+            if(found == material_names.end())
+                return in.fail("unknown material '" + name + "'");
+            shape.material = found->second;
+        }
+
+        bool ok;
+        if(keyword == "sphere") {
+            ok = in.numbers(shape.p, 0, 3) && in.number(shape.p[6]);
+            shape.p[3] = shape.p[0];
+            shape.p[4] = shape.p[1];
+            shape.p[5] = shape.p[2];
+            if(ok && in.peek() == "to") {
+                std::string to;
+                ok = in.word(to) && in.numbers(shape.p, 3, 3);
+            }
+        } else if(keyword == "quad") {
+            shape.kind = shape_kind::quad;
+            ok = in.numbers(shape.p, 0, 9);
+        } else if(keyword == "box") {
+            shape.kind = shape_kind::box;
+            ok = in.numbers(shape.p, 0, 6);
+        } else {
+            return in.fail("unknown shape '" + keyword + "'");
+        }
+        if(!ok || !parse_transforms(in, shape))
+            return false;
+
+        scene.shapes.push_back(shape);
+        return true;
+    }
+
+    bool parse_transforms(line_parser& in, shape_record& shape) {
+        if(in.at_end())
+            return true;
+
+        affine to_world;
+        while(!in.at_end()) {
+            std::string op;
+            in.word(op);
+            vec3 v;
+            double degrees;
+            if(op == "translate" && in.vector(v))
+                to_world = affine::translation(v) * to_world;
+            else if(op == "rotate_y" && in.number(degrees))
+                to_world = affine::rotation(vec3(0, 1, 0), degrees) * to_world;
+            else if(op == "rotate" && in.vector(v) && in.number(degrees))
+                to_world = affine::rotation(v, degrees) * to_world;
+            else if(op == "scale" && in.vector(v))
+                to_world = affine::scaling(v) * to_world;
+            else
+                return in.fail("bad transform '" + op + "'");
+        }
+        shape.transform = std::uint32_t(scene.transforms.size());
+        scene.transforms.push_back(to_world.m);
+        return true;
+    }
+};
+
+} // namespace detail
+
+inline bool parse_scene(const std::string& filename, scene_description& scene) {
+    std::ifstream file(filename);
+    if(!file) {
+        std::cerr << "ERROR: Could not open scene file '" << filename << "'.\n";
+        return false;
+    }
+
+    scene = scene_description();
+    detail::scene_parser parser(filename, scene);
+    std::string line;
+    for(int line_number = 1; std::getline(file, line); line_number++)
+        if(!parser.parse_line(line_number, line))
+            return false;
+    return true;
+}
+
+// Sets up `cam` from the scene's camera record, loading its environment map if it has one.
+inline void apply_camera(const scene_view& scene, camera& cam) {
+    const auto& settings = *scene.camera;
+    cam.aspect_ratio = settings.aspect_ratio;
+    cam.image_width = settings.image_width;
+    cam.samples_per_pixel = settings.samples_per_pixel;
+    cam.max_depth = settings.max_depth;
+    cam.background = color(settings.background[0], settings.background[1], settings.background[2]);
+    cam.vfov = settings.vfov;
+    cam.lookfrom = point3(settings.lookfrom[0], settings.lookfrom[1], settings.lookfrom[2]);
+    cam.lookat = point3(settings.lookat[0], settings.lookat[1], settings.lookat[2]);
+    cam.vup = vec3(settings.vup[0], settings.vup[1], settings.vup[2]);
+    cam.defocus_angle = settings.defocus_angle;
+    cam.focus_dist = settings.focus_dist;
+    cam.environment = nullptr;
+    if(settings.environment < scene.string_bytes)
+        cam.environment =
+            make_shared<environment_light>(scene.strings + settings.environment, settings.environment_scale);
+}
+
+// Textures, materials and the top-level objects of a scene (every shape that is not a medium boundary, then the
+// media), in record order.
+struct scene_objects {
+    std::vector<shared_ptr<texture>> textures;
+    std::vector<shared_ptr<material>> materials;
+    std::vector<shared_ptr<hittable>> objects;
+};
+
+inline shared_ptr<hittable> make_shape(const scene_view& scene, const shape_record& s,
+                                       const shared_ptr<material>& mat) {
+    const auto& p = s.p;
+    shared_ptr<hittable> shape;
+    switch(s.kind) {
+    case shape_kind::sphere:
+        if(p[0] == p[3] && p[1] == p[4] && p[2] == p[5])
+            shape = make_shared<sphere>(point3(p[0], p[1], p[2]), p[6], mat);
+        else
+            shape = make_shared<sphere>(point3(p[0], p[1], p[2]), point3(p[3], p[4], p[5]), p[6], mat);
+        break;
+    case shape_kind::quad:
+        shape = make_shared<quad>(point3(p[0], p[1], p[2]), vec3(p[3], p[4], p[5]), vec3(p[6], p[7], p[8]), mat);
+        break;
+    case shape_kind::box:
+        shape = make_shared<box>(point3(p[0], p[1], p[2]), point3(p[3], p[4], p[5]), mat);
+        break;
+    }
+
+    if(s.transform < scene.transform_count) {
+        affine to_world;
+        to_world.m = scene.transforms[s.transform];
+        shape = make_shared<transform>(shape, to_world);
+    }
+    return shape;
+}
+
+inline scene_objects instantiate(const scene_view& scene) {
+    scene_objects out;
+
+    auto texture_at = [&](std::uint32_t index) {
+        return index < out.textures.size() ? out.textures[index] : make_shared<solid_color>(color(0, 0, 0));
+    };
+    for(size_t i = 0; i < scene.texture_count; i++) {
+        const auto& t = scene.textures[i];
+        shared_ptr<texture> tex;
+        switch(t.kind) {
+        case texture_kind::solid:
+            tex = make_shared<solid_color>(color(t.rgb[0], t.rgb[1], t.rgb[2]));
+            break;
+        case texture_kind::checker:
+            tex = make_shared<checker_texture>(t.scale, texture_at(t.even), texture_at(t.odd));
+            break;
+        case texture_kind::noise:
+            tex = make_shared<noise_texture>(t.scale);
+            break;
+        case texture_kind::image:
+            tex = make_shared<image_texture>(t.filename < scene.string_bytes ? scene.strings + t.filename : "");
+            break;
+        }
+        out.textures.push_back(tex);
+    }
+
+    for(size_t i = 0; i < scene.material_count; i++) {
+        const auto& m = scene.materials[i];
+        shared_ptr<material> mat;
+        switch(m.kind) {
+        case material_kind::lambertian:
+            mat = make_shared<lambertian>(texture_at(m.tex));
+            break;
+        case material_kind::metal:
+            mat = make_shared<metal>(color(m.rgb[0], m.rgb[1], m.rgb[2]), m.param);
+            break;
+        case material_kind::dielectric:
+            mat = make_shared<dielectric>(m.param);
+            break;
+        case material_kind::diffuse_light:
+            mat = make_shared<diffuse_light>(texture_at(m.tex));
+            break;
+        case material_kind::isotropic:
+            mat = make_shared<isotropic>(texture_at(m.tex));
+            break;
+        }
+        out.materials.push_back(mat);
+    }
+
+    out.objects.reserve(scene.shape_count);
+    for(size_t i = 0; i < scene.shape_count; i++) {
+        const auto& s = scene.shapes[i];
+        if(s.material < out.materials.size())
+            out.objects.push_back(make_shape(scene, s, out.materials[s.material]));
+    }
+
+    for(size_t i = 0; i < scene.medium_count; i++) {
+        const auto& m = scene.media[i];
+        if(m.boundary >= scene.shape_count)
+            continue;
+        auto boundary = make_shape(scene, scene.shapes[m.boundary], nullptr);
+        out.objects.push_back(make_shared<constant_medium>(boundary, m.density, texture_at(m.tex)));
+    }
+
+    return out;
+}
+
+} // namespace scene_format
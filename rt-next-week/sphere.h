@@ -2,22 +2,24 @@
 
 #include "aabb.h"
 #include "hittable.h"
+#include "material.h"
 #include "ray.h"
 #include "rtweekend.h"
 #include "vec3.h"
 #include <cmath>
 #include <memory>
 #include <utility>
+#include <vector>
 
 class sphere : public hittable {
   public:
-    sphere(const point3& static_center, double radius, std::shared_ptr<material> mat)
+    sphere(const point3& static_center, real radius, std::shared_ptr<material> mat)
         : center(static_center, vec3(0, 0, 0)), radius(std::fmax(0, radius)), mat(std::move(mat)) {
         auto rvec = vec3(radius, radius, radius);
         bbox = aabb(static_center - rvec, static_center + rvec);
     }
 
-    sphere(const point3& center1, const point3& center2, double radius, std::shared_ptr<material> mat)
+    sphere(const point3& center1, const point3& center2, real radius, std::shared_ptr<material> mat)
         : center(center1, center2 - center1), radius(std::fmax(0, radius)), mat(std::move(mat)) {
         auto rvec = vec3(radius, radius, radius);
         aabb box1(center.at(0) - rvec, center.at(0) + rvec);
@@ -27,39 +29,118 @@ class sphere : public hittable {
 
     [[nodiscard]] aabb bounding_box() const override { return bbox; }
 
+    [[nodiscard]] aabb bounding_box_at(double time) const override {
+        auto rvec = vec3(radius, radius, radius);
+        return {center.at(time) - rvec, center.at(time) + rvec};
+    }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        point3 current_center = center.at(r.time());
-        vec3 oc = current_center - r.origin();
+        real root;
+        if(!nearest_root(r, center.at(r.time()), ray_t, root))
+            return false;
+
+        rec.t = root;
+        rec.object = this;
+        return true;
+    }
+
+    void finalize(const ray& r, hit_record& rec) const override {
+        // Put the point back on the sphere: the root carries far more rounding error than this step, which matters
+        // for large spheres in float.
+        auto current_center = center.at(r.time());
+        auto offset = r.at(rec.t) - current_center;
+        rec.p = current_center + (radius / offset.length()) * offset;
+        rec.p_error = rounding_error(radius + max_abs(rec.p));
+        vec3 outward_normal = (rec.p - current_center) / radius;
+        rec.set_face_normal(r, outward_normal);
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.texture_scale = texture_scale(outward_normal, radius);
+        rec.mat = mat.get();
+    }
+
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        real root;
+        return nearest_root(r, center.at(r.time()), ray_t, root);
+    }
+
+    void inside(const ray& r, interval ray_t, interval_list& spans) const override {
+        vec3 oc = center.at(r.time()) - r.origin();
         auto a = r.direction().length_squared();
         auto h = dot(r.direction(), oc);
-        auto c = oc.length_squared() - radius * radius;
+        auto discriminant = a * (radius * radius - (oc - (h / a) * r.direction()).length_squared());
+        if(discriminant < 0)
+            return;
 
-        auto discriminant = h * h - a * c;
+        auto sqrtd = std::sqrt(discriminant);
+        spans.add(interval(std::fmax((h - sqrtd) / a, ray_t.min), std::fmin((h + sqrtd) / a, ray_t.max)));
+    }
 
-        if(discriminant < 0.0)
-            return false;
+    void collect_lights(std::vector<const hittable*>& lights) const override {
+        if(mat->emits() && center.direction().near_zero())
+            lights.push_back(this);
+    }
 
-        auto sqrtd = std::sqrt(discriminant);
+    // Uniform over the cone of directions the sphere subtends from `origin` (stationary spheres only).
+    [[nodiscard]] double pdf_value(const point3& origin, const vec3& direction) const override {
+        auto distance_squared = (center.origin() - origin).length_squared();
+        hit_record rec;
+        if(distance_squared <= radius * radius ||
+           !hit(ray(origin, direction), interval(surface_epsilon(origin), infinity), rec))
+            return 0;
 
-        // Find the nearest root that lies in the acceptable range.
-        auto root = (h - sqrtd) / a;
-        if(root <= ray_t.min || ray_t.max <= root) {
-            root = (h + sqrtd) / a;
-            if(root <= ray_t.min || ray_t.max <= root)
-                return false;
-        }
+        auto cos_theta_max = std::sqrt(1 - radius * radius / distance_squared);
+        return 1 / (2 * pi * (1 - cos_theta_max));
+    }
 
-        rec.t = root;
-        rec.p = r.at(rec.t);
-        vec3 outward_normal = (rec.p - current_center) / radius;
-        rec.set_face_normal(r, outward_normal);
-        get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.mat = mat;
+    [[nodiscard]] vec3 random(const point3& origin) const override {
+        auto to_center = center.origin() - origin;
+        auto distance_squared = to_center.length_squared();
+        if(distance_squared <= radius * radius)
+            return to_center;
+
+        // Local frame around the axis of the cone.
+        auto w = unit_vector(to_center);
+        auto a = std::fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        auto v = unit_vector(cross(w, a));
+        auto u = cross(w, v);
 
+        auto z = 1 + random_double() * (std::sqrt(1 - radius * radius / distance_squared) - 1);
+        auto phi = 2 * pi * random_double();
+        auto sin_theta = std::sqrt(std::fmax(0.0, 1 - z * z));
+        return (std::cos(phi) * sin_theta) * u + (std::sin(phi) * sin_theta) * v + z * w;
+    }
+
+    bool sample_surface(hit_record& rec, double& total_area) const override {
+        auto outward_normal = random_unit_vector();
+        rec.p = center.origin() + radius * outward_normal;
+        rec.p_error = rounding_error(radius + max_abs(rec.p));
+        rec.normal = outward_normal;
+        rec.front_face = true;
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = mat.get();
+        total_area = 4 * pi * radius * radius;
         return true;
     }
 
-    static void get_sphere_uv(const point3& p, double& u, double& v) {
+    // Normals point every way: the cone is the whole sphere.
+    [[nodiscard]] light_bounds emission_bounds() const override {
+        auto c = center.origin();
+        auto radiance = mat->emitted(0.5, 0.5, c + vec3(0, radius, 0));
+        light_bounds b;
+        b.bounds = bbox;
+        b.power = std::fmax(radiance.x(), std::fmax(radiance.y(), radiance.z())) * 4 * pi * radius * radius * pi;
+        b.cos_theta_o = -1;
+        return b;
+    }
+
+    // (u, v) units per unit of length at the point with this normal: u runs around 2 pi r sin(theta) and v over
+    // pi r, and their geometric mean stands for both. Near the poles, where u bunches up, it is held finite.
+    static real texture_scale(const vec3& outward_normal, real radius) {
+        auto sin_theta = std::sqrt(std::fmax(0.0, 1 - double(outward_normal.y() * outward_normal.y())));
+        return real(1 / (pi * radius * std::sqrt(2 * std::fmax(sin_theta, 0.01))));
+    }
+
+    static void get_sphere_uv(const point3& p, real& u, real& v) {
         auto theta = std::acos(-p.y());
         auto phi = std::atan2(-p.z(), p.x()) + pi;
 
@@ -69,7 +150,32 @@ class sphere : public hittable {
 
   private:
     ray center;
-    double radius;
+    real radius;
     shared_ptr<material> mat;
     aabb bbox;
+
+    bool nearest_root(const ray& r, const point3& current_center, const interval& ray_t, real& root) const {
+        vec3 oc = current_center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+
+        // h^2 - a(|oc|^2 - r^2), rewritten with the offset from the center to the ray's closest approach. The
+        // textbook form cancels two terms of the size of the squared distance, which loses a far or large sphere
+        // entirely in float.
+        auto discriminant = a * (radius * radius - (oc - (h / a) * r.direction()).length_squared());
+
+        if(discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+
+        // Find the nearest root that lies in the acceptable range.
+        root = (h - sqrtd) / a;
+        if(root <= ray_t.min || ray_t.max <= root) {
+            root = (h + sqrtd) / a;
+            if(root <= ray_t.min || ray_t.max <= root)
+                return false;
+        }
+        return true;
+    }
 };
@@ -2,6 +2,7 @@
 
 #include "color.h"
 #include "interval.h"
+#include "mip_map.h"
 #include "perlin.h"
 #include "rtw_image.h"
 #include "rtweekend.h"
@@ -14,6 +15,12 @@ class texture {
     virtual ~texture() = default;
 
     [[nodiscard]] virtual color value(double u, double v, const point3& p) const = 0;
+
+    // Averaged over a footprint `width` across in (u, v) units around (u, v). Textures without detail to lose
+    // there ignore the width.
+    [[nodiscard]] virtual color filtered(double u, double v, const point3& p, double width) const {
+        return value(u, v, p);
+    }
 };
 
 class solid_color : public texture {
@@ -46,33 +53,39 @@ class checker_texture : public texture {
         return isEven ? even->value(u, v, p) : odd->value(u, v, p);
     }
 
+    // The checks are solid, not (u, v), so only the colors are filtered.
+    [[nodiscard]] color filtered(double u, double v, const point3& p, double width) const override {
+        auto xInteger = int(std::floor(inv_scale * p.x()));
+        auto yInteger = int(std::floor(inv_scale * p.y()));
+        auto zInteger = int(std::floor(inv_scale * p.z()));
+
+        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+
+        return isEven ? even->filtered(u, v, p, width) : odd->filtered(u, v, p, width);
+    }
+
   private:
     double inv_scale;
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
 };
 
+// Mip-mapped: the image is only kept as its mip chain.
 class image_texture : public texture {
   public:
-    image_texture(const std::string& filename) : image(filename) {}
+    image_texture(const std::string& filename) : image(rtw_image(filename)) {}
 
-    [[nodiscard]] color value(double u, double v, const point3& p) const override {
-        if(image.height() <= 0)
-            return {0, 1, 1};
-
-        u = interval(0, 1).clamp(u);
-        v = 1.0 - interval(0, 1).clamp(v);
+    [[nodiscard]] color value(double u, double v, const point3& p) const override { return filtered(u, v, p, 0); }
 
-        auto i = int(u * image.width());
-        auto j = int(v * image.height());
-        auto pixel = image.pixel_data(i, j);
+    [[nodiscard]] color filtered(double u, double v, const point3& p, double width) const override {
+        if(image.empty())
+            return {0, 1, 1};
 
-        auto color_scale = 1.0 / 255.0;
-        return {color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]};
+        return image.lookup(u, 1 - v, width);
     }
 
   private:
-    rtw_image image;
+    mip_map image;
 };
 
 class noise_texture : public texture {
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "aabb.h"
+#include "compressed_bvh.h"
+#include "hittable.h"
+#include "interval.h"
+#include "mesh_loader.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "vec3.h"
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Indexed triangle mesh over a shared vertex buffer, with its own BVH over the triangles. Rays are tested with the
+// watertight algorithm of Woop, Benthin and Wald, so rays through shared edges and vertices never slip between
+// neighbouring triangles.
+class triangle_mesh : public hittable {
+  public:
+    triangle_mesh(shared_ptr<const mesh_data> mesh, shared_ptr<material> mat)
+        : mesh(std::move(mesh)), mat(std::move(mat)) {
+        build();
+    }
+
+    triangle_mesh(const std::string& filename, shared_ptr<material> mat) : mat(std::move(mat)) {
+        auto loaded = make_shared<mesh_data>();
+        if(!load_mesh(filename, *loaded))
+            loaded = make_shared<mesh_data>();
+        mesh = loaded;
+        build();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        const watertight_ray wr(r);
+        std::uint32_t hit_triangle = 0;
+        real hit_t = 0;
+        std::array<real, 3> bary{};
+
+        bool hit_anything = tree.traverse(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            bool found = false;
+            for(auto i = first; i < first + count; i++) {
+                real t_hit;
+                std::array<real, 3> b;
+                if(intersect(wr, i, t, t_hit, b)) {
+                    found = true;
+                    t.max = t_hit;
+                    hit_t = t_hit;
+                    hit_triangle = i;
+                    bary = b;
+                }
+            }
+            return found;
+        });
+
+        if(!hit_anything)
+            return false;
+
+        rec.t = hit_t;
+        rec.u = bary[1];
+        rec.v = bary[2];
+        rec.object = this;
+        rec.primitive = hit_triangle;
+        return true;
+    }
+
+    void finalize(const ray& r, hit_record& rec) const override {
+        const auto v0 = vertex(triangles[3 * rec.primitive]);
+        const auto v1 = vertex(triangles[3 * rec.primitive + 1]);
+        const auto v2 = vertex(triangles[3 * rec.primitive + 2]);
+
+        rec.p = (1 - rec.u - rec.v) * v0 + rec.u * v1 + rec.v * v2;
+        rec.mat = mat.get();
+        // The barycentrics are the texture coordinates, and cover an area of one half over the triangle.
+        auto n = cross(v1 - v0, v2 - v0);
+        rec.set_face_normal(r, unit_vector(n));
+        rec.texture_scale = 1 / std::sqrt(n.length());
+    }
+
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        const watertight_ray wr(r);
+        return tree.traverse_any(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            for(auto i = first; i < first + count; i++) {
+                real t_hit;
+                std::array<real, 3> b;
+                if(intersect(wr, i, t, t_hit, b))
+                    return true;
+            }
+            return false;
+        });
+    }
+
+    [[nodiscard]] aabb bounding_box() const override { return tree.bounds(); }
+
+    [[nodiscard]] size_t triangle_count() const { return triangles.size() / 3; }
+
+  private:
+    // Per-ray constants of the watertight test: the dominant axis becomes z and the ray is sheared onto +z.
+    struct watertight_ray {
+        int kx, ky, kz;
+        real sx, sy, sz;
+        point3 origin;
+
+        explicit watertight_ray(const ray& r) : origin(r.origin()) {
+            const vec3& d = r.direction();
+            kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                                                     : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            if(d[kz] < 0)
+                std::swap(kx, ky);
+
+            sx = d[kx] / d[kz];
+            sy = d[ky] / d[kz];
+            sz = 1 / d[kz];
+        }
+    };
+
+    shared_ptr<const mesh_data> mesh;
+    shared_ptr<material> mat;
+    std::vector<std::uint32_t> triangles; // vertex indices in BVH leaf order
+    quantized_bvh<std::uint8_t> tree;
+
+    [[nodiscard]] point3 vertex(std::uint32_t index) const { return {mesh->x[index], mesh->y[index], mesh->z[index]}; }
+
+    void build() {
+        const auto& indices = mesh->indices;
+        std::vector<aabb> boxes(indices.size() / 3);
+        for(size_t i = 0; i < boxes.size(); i++) {
+            auto v0 = vertex(indices[3 * i]);
+            auto v1 = vertex(indices[3 * i + 1]);
+            auto v2 = vertex(indices[3 * i + 2]);
+            boxes[i] = aabb(aabb(v0, v1), aabb(v2, v2));
+        }
+
+        tree.build(boxes);
+
+        triangles.reserve(indices.size());
+        for(auto prim : tree.primitive_order())
+            for(int k = 0; k < 3; k++)
+                triangles.push_back(indices[3 * prim + k]);
+    }
+
+    bool intersect(const watertight_ray& wr, std::uint32_t tri, const interval& ray_t, real& t,
+                   std::array<real, 3>& bary) const {
+        const auto i0 = triangles[3 * tri];
+        const auto i1 = triangles[3 * tri + 1];
+        const auto i2 = triangles[3 * tri + 2];
+
+        const vec3 a = vertex(i0) - wr.origin;
+        const vec3 b = vertex(i1) - wr.origin;
+        const vec3 c = vertex(i2) - wr.origin;
+
+        const real ax = a[wr.kx] - wr.sx * a[wr.kz];
+        const real ay = a[wr.ky] - wr.sy * a[wr.kz];
+        const real bx = b[wr.kx] - wr.sx * b[wr.kz];
+        const real by = b[wr.ky] - wr.sy * b[wr.kz];
+        const real cx = c[wr.kx] - wr.sx * c[wr.kz];
+        const real cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+        // Scaled barycentrics as 2D edge functions; mixed signs mean the ray passes outside.
+        real u = cx * by - cy * bx;
+        real v = ax * cy - ay * cx;
+        real w = bx * ay - by * ax;
+        // An edge function that rounds to zero in float is redone in double, so a ray through a shared edge is
+        // still claimed by one of the two triangles.
+        if constexpr(std::is_same_v<real, float>) {
+            if(u == 0 || v == 0 || w == 0) {
+                u = real(double(cx) * double(by) - double(cy) * double(bx));
+                v = real(double(ax) * double(cy) - double(ay) * double(cx));
+                w = real(double(bx) * double(ay) - double(by) * double(ax));
+            }
+        }
+        if((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            return false;
+
+        const real det = u + v + w;
+        if(det == 0)
+            return false;
+
+        const real az = wr.sz * a[wr.kz];
+        const real bz = wr.sz * b[wr.kz];
+        const real cz = wr.sz * c[wr.kz];
+        t = (u * az + v * bz + w * cz) / det;
+        if(t <= ray_t.min || ray_t.max <= t)
+            return false;
+
+        bary = {u / det, v / det, w / det};
+        return true;
+    }
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "aabb.h"
+#include "box.h"
+#include "compressed_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "interval.h"
+#include "quad.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "sphere.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <typeinfo>
+#include <vector>
+
+// BVH whose primitives are stored by value in one contiguous array per type. Spheres, quads and boxes are copied
+// out of their shared_ptrs; a leaf lists typed references, grouped by type, and dispatches on the type with a
+// switch and statically bound calls instead of a virtual call per primitive. Anything else (transforms, media,
+// nested structures) stays behind its shared_ptr and is called virtually.
+class typed_bvh : public hittable {
+  public:
+    typed_bvh(const hittable_list& list) : typed_bvh(list.objects) {}
+
+    typed_bvh(const std::vector<shared_ptr<hittable>>& objects) {
+        std::vector<aabb> boxes;
+        std::vector<std::uint32_t> typed;
+        boxes.reserve(objects.size());
+        typed.reserve(objects.size());
+
+        for(const auto& object : objects) {
+            boxes.push_back(object->bounding_box());
+            // Exact types only: copying a subclass out by value would slice it.
+            const auto& type = typeid(*object);
+            if(type == typeid(sphere)) {
+                typed.push_back(make_ref(kind_sphere, spheres.size()));
+                spheres.push_back(static_cast<const sphere&>(*object));
+            } else if(type == typeid(quad)) {
+                typed.push_back(make_ref(kind_quad, quads.size()));
+                quads.push_back(static_cast<const quad&>(*object));
+            } else if(type == typeid(box)) {
+                typed.push_back(make_ref(kind_box, this->boxes.size()));
+                this->boxes.push_back(static_cast<const box&>(*object));
+            } else {
+                typed.push_back(make_ref(kind_other, others.size()));
+                others.push_back(object);
+            }
+        }
+
+        tree.build(boxes);
+
+        refs.reserve(typed.size());
+        for(auto index : tree.primitive_order())
+            refs.push_back(typed[index]);
+
+        // Group each leaf by type so the dispatch switch sees runs of the same case.
+        tree.for_each_leaf([&](std::uint32_t first, std::uint32_t count) {
+            std::stable_sort(refs.begin() + first, refs.begin() + first + count,
+                             [](std::uint32_t a, std::uint32_t b) { return ref_kind(a) < ref_kind(b); });
+        });
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return tree.traverse(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            bool hit_anything = false;
+            for(auto i = first; i < first + count; i++) {
+                if(hit_ref(refs[i], r, t, rec)) {
+                    hit_anything = true;
+                    t.max = rec.t;
+                }
+            }
+            return hit_anything;
+        });
+    }
+
+    [[nodiscard]] bool occluded(const ray& r, interval ray_t) const override {
+        return tree.traverse_any(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            for(auto i = first; i < first + count; i++)
+                if(occluded_ref(refs[i], r, t))
+                    return true;
+            return false;
+        });
+    }
+
+    // Spheres, quads and boxes are opaque; only the others can let part of the light through.
+    [[nodiscard]] double transmittance(const ray& r, interval ray_t) const override {
+        double fraction = 1;
+        tree.traverse_any(r, ray_t, [&](std::uint32_t first, std::uint32_t count, interval& t) {
+            for(auto i = first; i < first + count && fraction > 0; i++) {
+                if(ref_kind(refs[i]) == kind_other)
+                    fraction *= others[ref_index(refs[i])]->transmittance(r, t);
+                else if(occluded_ref(refs[i], r, t))
+                    fraction = 0;
+            }
+            return fraction <= 0;
+        });
+        return fraction;
+    }
+
+    [[nodiscard]] aabb bounding_box() const override { return tree.bounds(); }
+
+    // Boxes cannot be sampled as lights.
+    void collect_lights(std::vector<const hittable*>& lights) const override {
+        for(const auto& s : spheres)
+            s.collect_lights(lights);
+        for(const auto& q : quads)
+            q.collect_lights(lights);
+        for(const auto& object : others)
+            object->collect_lights(lights);
+    }
+
+    [[nodiscard]] size_t sphere_count() const { return spheres.size(); }
+    [[nodiscard]] size_t quad_count() const { return quads.size(); }
+    [[nodiscard]] size_t box_count() const { return boxes.size(); }
+    [[nodiscard]] size_t other_count() const { return others.size(); }
+
+  private:
+    // A reference is the primitive kind in the top two bits and the index into that kind's array below.
+    static constexpr std::uint32_t kind_sphere = 0, kind_quad = 1, kind_box = 2, kind_other = 3;
+
+    static std::uint32_t make_ref(std::uint32_t kind, size_t index) { return kind << 30 | std::uint32_t(index); }
+    static std::uint32_t ref_kind(std::uint32_t ref) { return ref >> 30; }
+    static std::uint32_t ref_index(std::uint32_t ref) { return ref & 0x3fffffffu; }
+
+    std::vector<sphere> spheres;
+    std::vector<quad> quads;
+    std::vector<box> boxes;
+    std::vector<shared_ptr<hittable>> others;
+    std::vector<std::uint32_t> refs; // in leaf order
+    quantized_bvh<std::uint8_t> tree;
+
+    // Qualified calls bind statically: the arrays hold exactly these types.
+    bool hit_ref(std::uint32_t ref, const ray& r, const interval& t, hit_record& rec) const {
+        auto index = ref_index(ref);
+        switch(ref_kind(ref)) {
+        case kind_sphere:
+            return spheres[index].sphere::hit(r, t, rec);
+        case kind_quad:
+            return quads[index].quad::hit(r, t, rec);
+        case kind_box:
+            return boxes[index].box::hit(r, t, rec);
+        default:
+            return others[index]->hit(r, t, rec);
+        }
+    }
+
+    [[nodiscard]] bool occluded_ref(std::uint32_t ref, const ray& r, const interval& t) const {
+        auto index = ref_index(ref);
+        switch(ref_kind(ref)) {
+        case kind_sphere:
+            return spheres[index].sphere::occluded(r, t);
+        case kind_quad:
+            return quads[index].quad::occluded(r, t);
+        case kind_box:
+            return boxes[index].box::occluded(r, t);
+        default:
+            return others[index]->occluded(r, t);
+        }
+    }
+};
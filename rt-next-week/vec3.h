@@ -2,106 +2,127 @@
 
 #include "rtweekend.h"
 #include <array>
+#include <cassert>
 #include <cmath>
 #include <iostream>
-#include <stdexcept>
 
-class vec3 {
+// Three-component vector over the scalar type T. The renderer uses vec3, over `real`; the scalar argument of the
+// free operators is not deduced, so plain literals and doubles mix with either precision.
+template <typename T> class basic_vec3 {
   public:
-    std::array<double, 3> e;
+    using scalar = T;
 
-    vec3(const vec3&) = default;
-    vec3& operator=(const vec3& v) = default;
-    vec3(vec3&& other) noexcept = default;
-    vec3& operator=(vec3&& other) noexcept = default;
+    std::array<T, 3> e;
 
-    vec3() : e{0, 0, 0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    basic_vec3(const basic_vec3&) = default;
+    basic_vec3& operator=(const basic_vec3& v) = default;
+    basic_vec3(basic_vec3&& other) noexcept = default;
+    basic_vec3& operator=(basic_vec3&& other) noexcept = default;
 
-    [[nodiscard]] double x() const { return e[0]; }
-    [[nodiscard]] double y() const { return e[1]; }
-    [[nodiscard]] double z() const { return e[2]; }
+    basic_vec3() : e{0, 0, 0} {}
+    basic_vec3(T e0, T e1, T e2) : e{e0, e1, e2} {}
 
-    vec3 operator-() const { return {-e[0], -e[1], -e[2]}; }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    // Converts between precisions.
+    template <typename U>
+    explicit basic_vec3(const basic_vec3<U>& v) : e{T(v.e[0]), T(v.e[1]), T(v.e[2])} {}
 
-    vec3& operator+=(const vec3& v) {
+    [[nodiscard]] T x() const { return e[0]; }
+    [[nodiscard]] T y() const { return e[1]; }
+    [[nodiscard]] T z() const { return e[2]; }
+
+    basic_vec3 operator-() const { return {-e[0], -e[1], -e[2]}; }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
+
+    basic_vec3& operator+=(const basic_vec3& v) {
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
         return *this;
     }
 
-    vec3& operator*=(double t) {
+    basic_vec3& operator*=(T t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    vec3& operator/=(double t) {
-        if(t == 0.0)
-            throw std::invalid_argument("Division by zero");
+    basic_vec3& operator/=(T t) {
+        assert(t != 0 && "division by zero");
         return *this *= 1 / t;
     }
 
-    [[nodiscard]] double length() const { return std::sqrt(length_squared()); }
+    [[nodiscard]] T length() const { return std::sqrt(length_squared()); }
 
-    [[nodiscard]] double length_squared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+    [[nodiscard]] T length_squared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
 
-    static vec3 random() {
-        return {random_double(), random_double(), random_double()};
+    static basic_vec3 random() {
+        return {T(random_double()), T(random_double()), T(random_double())};
     }
 
-    static vec3 random(double min, double max) {
-        return {random_double(min,max), random_double(min,max), random_double(min,max)};
+    static basic_vec3 random(double min, double max) {
+        return {T(random_double(min, max)), T(random_double(min, max)), T(random_double(min, max))};
     }
 
     bool near_zero() const {
-        auto s = 1e-8;
+        auto s = T(1e-8);
         return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
     }
 };
 
+using vec3 = basic_vec3<real>;
 using point3 = vec3;
 
-inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
+// Keeps a scalar parameter out of template argument deduction.
+template <typename T> using scalar_of = typename basic_vec3<T>::scalar;
+
+template <typename T> inline std::ostream& operator<<(std::ostream& out, const basic_vec3<T>& v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3& u, const vec3& v) { return {u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]}; }
+template <typename T> inline basic_vec3<T> operator+(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return {u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]};
+}
 
-inline vec3 operator-(const vec3& u, const vec3& v) { return {u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]}; }
+template <typename T> inline basic_vec3<T> operator-(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return {u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]};
+}
 
-inline vec3 operator*(const vec3& u, const vec3& v) { return {u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]}; }
+template <typename T> inline basic_vec3<T> operator*(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return {u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]};
+}
 
-inline vec3 operator*(double t, const vec3& v) { return {t * v.e[0], t * v.e[1], t * v.e[2]}; }
+template <typename T> inline basic_vec3<T> operator*(scalar_of<T> t, const basic_vec3<T>& v) {
+    return {t * v.e[0], t * v.e[1], t * v.e[2]};
+}
 
-inline vec3 operator*(const vec3& u, double t) { return t * u; }
+template <typename T> inline basic_vec3<T> operator*(const basic_vec3<T>& u, scalar_of<T> t) { return t * u; }
 
-inline vec3 operator/(const vec3& u, double t) { return (1 / t) * u; }
+template <typename T> inline basic_vec3<T> operator/(const basic_vec3<T>& u, scalar_of<T> t) { return (1 / t) * u; }
 
-inline double dot(const vec3& u, const vec3& v) { return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2]; }
+template <typename T> inline T dot(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
+}
 
-inline vec3 cross(const vec3& u, const vec3& v) {
+template <typename T> inline basic_vec3<T> cross(const basic_vec3<T>& u, const basic_vec3<T>& v) {
     return {u.e[1] * v.e[2] - u.e[2] * v.e[1], u.e[2] * v.e[0] - u.e[0] * v.e[2], u.e[0] * v.e[1] - u.e[1] * v.e[0]};
 }
 
-inline vec3 unit_vector(const vec3& v) {
-    double len = v.length();
-    if(len == 0.0)
-        throw std::invalid_argument("Cannot compute unit vector of zero length vector");
-    return v / v.length();
+// Zero vectors are the caller's bug; debug builds assert, release builds return non-finite components.
+template <typename T> inline basic_vec3<T> unit_vector(const basic_vec3<T>& v) {
+    T len = v.length();
+    assert(len > 0 && "unit vector of a zero length vector");
+    return v / len;
 }
 
+// Uniform on the sphere: z is uniform in [-1, 1] (Archimedes) and the angle around the z axis uniform. Two random
+// numbers and no rejection loop, where sampling the cube took six on average and a branch per try.
 inline vec3 random_unit_vector() {
-    while(true) {
-        auto p = vec3::random(-1, 1);
-        auto lensq = p.length_squared();
-        if(1e-160 < lensq && lensq <= 1)
-            return p / sqrt(lensq);
-    }
+    auto z = 1 - 2 * random_double();
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * random_double();
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
 inline vec3 random_on_hemisphere(const vec3& normal) {
@@ -114,10 +135,10 @@ inline vec3 random_on_hemisphere(const vec3& normal) {
 
 inline vec3 reflect(const vec3& v, const vec3& n) { return v - 2 * dot(v, n) * n; }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
+    auto cos_theta = std::fmin(dot(-uv, n), real(1));
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+    vec3 r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 